@@ -6,6 +6,8 @@
  * castleInfo -> Int that holds the availability of the 4 diff castles
  * enPass -> Index of the pawn that moved 2 sqrs in the last turn, otherwise 0
  * fifty -> 50 move rule counter
+ * psqt -> Material and psts of all the pieces (opening and endgame), positive if it is good for white.
+ *         It is updated with each move, see PSQT in evaluation.c
  */
 
 typedef struct
@@ -19,11 +21,13 @@ typedef struct
     int castleInfo;
     int enPass;
     int fifty;
+    int psqt[2];
 } Board;
 
 const int textToPiece(char piece);
 
 Board genFromFen(char* const fen, int* counter);
+int validFen(const char* fen);
 const Board defaultBoard(void);
 
 int equal(const Board* a, const Board* b);
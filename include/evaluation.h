@@ -1,7 +1,32 @@
 void initEval(void);
-__attribute__((hot)) int eval(const Board* b);
+__attribute__((hot)) int eval(const Board* b, const int alpha, const int beta, int* lazy);
+#ifdef DEBUG
+void lazyEvalCounts(uint64_t* evals, uint64_t* psqtExits, uint64_t* cheapExits);
+#endif
+
+#ifdef TRAIN
+#define MAX_TRACE 32
+
+/* White's [OP, EG] score of an eval as a linear function of the values,
+ * result = constant part + sum(coeff[i] * term[i])
+ */
+typedef struct
+{
+    int n;
+    const int* term[MAX_TRACE];
+    int coeff[MAX_TRACE];
+
+    int ph;
+    int result[2];
+} EvalTrace;
+
+int traceEval(const Board* b, EvalTrace* t);
+#endif
 int fastEval(const Board* b);
 int insuffMat(const Board* b);
+void computePSQT(Board* b);
+
+extern int PSQT[2][6][64][2];
 
 extern int V_QUEEN[2];
 extern int V_ROOK[2];
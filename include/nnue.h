@@ -2,10 +2,38 @@
 #define weight_t int8_t
 #define clipped_t int8_t
 
+/* Where the feature transformer is: malloced, in the embedded net
+ * or in a shared memory segment (ftMapping, ftFd holds its lock, see freeNNUE)
+ */
+enum {FT_MALLOC, FT_EMBEDDED, FT_SHARED};
+
+/* Architecture of a net, all of them are HalfKP with halfDims outputs of the feature transformer
+ * per perspective followed by 32-32-1. It is detected from the hash of the file, the rest is the layout
+ * archSize -> Length of the description string in the header
+ */
+typedef struct
+{
+    int halfDims;
+    uint32_t hash;
+    uint32_t archSize;
+    size_t ftOffset;
+    size_t ftSize;
+    size_t networkOffset;
+    size_t networkSize;
+    size_t fileSize;
+} NNUEArch;
+
+/* The buffers are sized for the biggest architecture (kHalfDimensionFT), smaller nets only use the start
+ */
 typedef struct
 {
+    NNUEArch arch;
     int16_t* ftBiases;
     int16_t* ftWeights;
+    int ftStorage;
+    void* ftMapping;
+    size_t ftMappingSize;
+    int ftFd;
 
     weight_t weights1[32*512];
     weight_t weights2[32*32];
@@ -24,12 +52,17 @@ typedef struct
     int appears;
 } NNUEChange;
 
+/* Changes of the inputs after a move
+ * refresh -> Perspective that has to be refreshed because its king moved, -1 if none
+ */
 typedef struct
 {
     NNUEChange changes[4];
     int idx;
+    int refresh;
 } NNUEChangeList;
 
+//kHalfDimensionFT is the biggest feature transformer supported, see SupportedArchs
 enum
 {
     kHalfDimensionFT = 256,
@@ -38,6 +71,43 @@ enum
     kInputDimensionsFT = 41024
 };
 
+/* Accumulator of the feature transformer for a ply of the search
+ * acc -> Output of the feature transformer, first the WHITE perspective and then the BLACK one
+ * computed -> If the perspective of each color is up to date
+ * dirty -> Changes of the move that lead to this ply, to update it from the previous ply
+ */
+typedef struct
+{
+    int16_t acc[kDimensionFT];
+    int computed[2];
+    NNUEChangeList dirty;
+} NNUEAccumulator;
+
+/* Accumulator of the last refresh of a perspective with its king in a given sqr, along with the
+ * pieces it was computed with, so the next refresh only has to apply the pieces that differ
+ */
+typedef struct
+{
+    int16_t acc[kHalfDimensionFT];
+    uint64_t piece[2][6];
+} FinnyEntry;
+
+//Enough for the plies of the main search plus the qsearch and the null move searches
+#define ACC_STACK_SIZE (MAX_PLY + 128)
+
+/* Everything an evaluation writes, each thread needs its own, the net is only read so it can be shared
+ * nn -> Net it evaluates with, initEvaluator has to be called again if it changes
+ * accStack -> Accumulator of each ply, accIdx is the current one
+ * finny -> Last refresh of each perspective with its king in each sqr
+ */
+typedef struct
+{
+    const NNUE* nn;
+    NNUEAccumulator accStack[ACC_STACK_SIZE];
+    int accIdx;
+    FinnyEntry finny[2][64];
+} NNUEEvaluator;
+
 enum {
     FV_SCALE = 16,
     SHIFT = 6,
@@ -48,11 +118,26 @@ static const unsigned int NNUEVersion = 0x7AF32F16u;
 
 void initNNUE(const char* path);
 NNUE loadNNUE(const char* path);
+int tryLoadNNUE(const char* path, NNUE* nn);
+void loadNNUEAsync(const char* path);
+int swapNNUE(const int wait);
 void freeNNUE(NNUE* nn);
 void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t* inp);
 void determineChanges(const Move m, NNUEChangeList* list, const int color);
 int evaluateNNUE(const Board* b, const int useAcc);
 
+void initEvaluator(NNUEEvaluator* ev, const NNUE* nn);
+NNUEEvaluator* newEvaluator(const NNUE* nn);
+void freeEvaluator(NNUEEvaluator* ev);
+void evaluatorSetPosition(NNUEEvaluator* ev, const Board* b);
+void evaluatorDo(NNUEEvaluator* ev, const Move m, const Board* b);
+void evaluatorUndo(NNUEEvaluator* ev);
+int evaluatorEval(NNUEEvaluator* ev, const Board* const b, const int useAcc);
+const NNUE* loadedNNUE(void);
+void evaluateBatch(const NNUE* nn, const Board* boards, int* scores, const int n, int threads);
+void profileNNUE(const NNUE* nn, const Board* positions, const Move* moves, const int n, const int iterations);
+
+//Same as the ones above, with the evaluator of the search
 void initNNUEAcc(const Board* b);
-void updateDo(NNUEChangeList* q, const Move m, const Board* const b);
-void updateUndo(NNUEChangeList* q, const Board* const b);
\ No newline at end of file
+void updateDo(const Move m, const Board* const b);
+void updateUndo(void);
\ No newline at end of file
@@ -0,0 +1,41 @@
+/* Computes out = in + sum(add) - sum(sub) for rows of dims int16_t, dims is a multiple of 128
+ * out and in can be the same buffer, the rows can't overlap out
+ */
+typedef void (*FTUpdateKernel)(int16_t* out, const int16_t* in, const int16_t** add, const int numAdd, const int16_t** sub, const int numSub, const int dims);
+/* Clips the output of the feature transformer (halfDims of each perspective) into the input of the first layer,
+ * the perspective of stm goes first and the order is the one of permuteInput
+ */
+typedef void (*ClipInputKernel)(clipped_t* out, const int16_t* acc, const int stm, const int halfDims);
+/* Hidden layer of kDimensionHidden outputs with the clipped relu, weights are [output][input],
+ * inSize has to be a multiple of 32
+ */
+typedef void (*AffineKernel)(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs);
+/* First layer with the weights in blocks of 4 inputs, [block][output][4], the blocks of
+ * inputs that are all zero are skipped
+ */
+typedef void (*SparseAffineKernel)(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs);
+typedef int32_t (*OutputKernel)(const clipped_t* in, const weight_t* ws, const int32_t bias);
+
+void initKernels(void);
+void defaultKernels(void);
+int kernelSets(void);
+int selectedKernels(void);
+int selectKernels(const int k);
+const char* kernelName(void);
+void benchKernels(void);
+
+extern FTUpdateKernel ftUpdate;
+extern ClipInputKernel clipInput;
+extern AffineKernel affine;
+extern SparseAffineKernel affineSparse;
+extern OutputKernel affineOutput;
+
+/* Packing two registers of int16_t into int8_t with AVX2 interleaves their 128 bit lanes,
+ * in every block of 32 inputs the middle blocks of 8 are swapped. The input of the first layer
+ * is kept in that order (and its weights are permuted when loading) so it isn't shuffled back
+ */
+inline static int permuteInput(const int j)
+{
+    const int k = j & 31;
+    return (k >= 8 && k < 24)? j ^ 24 : j;
+}
@@ -0,0 +1,46 @@
+/* A position in 32 bytes, the record of the binary position files
+ * occupied -> bb with all the pieces
+ * pieces -> 4 bits per piece (color << 3 | piece) in the order of occupied from the lsb, low nibble first
+ * flags -> stm | castleInfo << 1
+ * result -> RESULT_BLACK, RESULT_DRAW or RESULT_WHITE, RESULT_NONE if the position isn't used
+ * score -> Evaluation for white, NO_SCORE if it isn't known
+ */
+typedef struct
+{
+    uint64_t occupied;
+    uint8_t pieces[16];
+    uint8_t flags;
+    uint8_t enPass;
+    uint8_t fifty;
+    uint8_t result;
+    int16_t score;
+    uint16_t reserved;
+} PackedPos;
+
+#define RESULT_BLACK 0
+#define RESULT_DRAW  1
+#define RESULT_WHITE 2
+#define RESULT_NONE  0xff
+#define NO_SCORE     INT16_MIN
+
+/* A position file mapped into memory, the records are read from the disk as they are used
+ */
+typedef struct
+{
+    const PackedPos* pos;
+    uint64_t count;
+
+    void* data;
+    size_t size;
+} PositionFile;
+
+PackedPos packPosition(const Board* b, const int result, const int score);
+int validPosition(const PackedPos* p);
+Board unpackPosition(const PackedPos* p);
+int parseResult(const char c);
+
+int openPositions(const char* path, PositionFile* file);
+void closePositions(PositionFile* file);
+FILE* createPositions(const char* path);
+void writePositions(FILE* fp, const PackedPos* pos, const uint64_t n);
+int finishPositions(FILE* fp);
\ No newline at end of file
@@ -15,4 +15,9 @@ typedef struct
 } SearchData;
 
 Move bestTime(Board b, Repetition rep, SearchParams sp);
-__attribute__((hot)) int qsearch(Board b, int alpha, const int beta, const int d);
\ No newline at end of file
+uint64_t searchedNodes(void);
+#ifdef DEBUG
+void evalCounts(uint64_t* nnue, uint64_t* lazy);
+#endif
+void setLazyMargin(const int margin);
+__attribute__((hot)) int qsearch(Board b, int alpha, const int beta, const int d, const uint64_t prevHash);
\ No newline at end of file
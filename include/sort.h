@@ -1,13 +1,39 @@
+/* Selection based move picker, the scores are assigned when it is initialized, but the SEE
+ * of the captures is only calculated once they are the best remaining move
+ * list -> Moves from the position, they are reordered as they are picked
+ * b -> Position the moves are played from
+ * numMoves -> Number of moves in the list
+ * lazy -> Flags for the moves whose score is an upper bound and still need the SEE
+ */
+typedef struct
+{
+    Move* list;
+    const Board* b;
+    int numMoves;
+    char lazy[NMOVES];
+} MovePicker;
+
 void initSort(void);
 void initKM(void);
 void initHistory(void);
 void addKM(const Move m, const int depth);
 void addHistory(const int from, const int to, const int n, const int stm);
 void decHistory(const int from, const int to, const int n, const int stm);
+void addCounterMove(const Move prev, const Move m, const int stm);
+void addContHistory(const Move prev, const Move prev2, const Move m, const int n);
+void decContHistory(const Move prev, const Move prev2, const Move m, const int n);
 __attribute__((hot)) void assignScores(Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth);
 __attribute__((hot)) void assignScoresQuiesce(Board* b, Move* list, const int numMoves);
+void initPicker(MovePicker* mp, const Board* b, Move* list, const int numMoves, const Move bestFromPos, const Move prev, const Move prev2, const int depth);
+void initPickerQuiesce(MovePicker* mp, const Board* b, Move* list, const int numMoves);
+__attribute__((hot)) Move pickMove(MovePicker* mp, const int idx);
+int seeCapture(const Board* b, const Move m);
+int seeGE(const Board* b, const Move m, const int threshold);
 int compMoves(const Move* m1, const Move* m2);
 void sort(Move* start, Move* end);
 void moveToFst(Move* list, int idx);
 
-extern int history[2][4096];
\ No newline at end of file
+extern int history[2][4096];
+#ifdef DEBUG
+extern uint64_t seeCalls;
+#endif
\ No newline at end of file
@@ -1,2 +1,3 @@
 void loop(void);
+void evalFens(int threads);
 void infoString(const Move m, const int depth, const uint64_t nodes, const clock_t duration);
\ No newline at end of file
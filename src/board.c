@@ -16,6 +16,7 @@
 #include <assert.h>
 #include "../include/global.h"
 #include "../include/board.h"
+#include "../include/evaluation.h"
 
 #define INITIAL_WPIECES 0xffff
 #define INITIAL_WPAWN 0xff00
@@ -144,10 +145,69 @@ Board genFromFen(char* const fen, int* counter)
     if (b.castleInfo > 0xf)
         b.castleInfo &= 0xf;
 
+    computePSQT(&b);
+
     *counter = i;
     return b;
 }
 
+/* Returns 1 if genFromFen can read the fen: 8 ranks of 8 sqrs with a king of each color and no pawns
+ * in the first and last ranks, the side to move, the castling rights and the en passant sqr (or '-').
+ * The move counters are optional
+ */
+int validFen(const char* fen)
+{
+    int i, sqrs = 0, ranks = 1, pieces = 0, kings[2] = {0, 0};
+    for (i = 0; fen[i] != ' '; ++i)
+    {
+        const int piece = textToPiece(fen[i]);
+        if (fen[i] == '/')
+        {
+            if (sqrs != 8 * ranks++)
+                return 0;
+        }
+        else if (fen[i] >= '1' && fen[i] <= '8')
+            sqrs += fen[i] - '0';
+        else if (piece != NO_PIECE)
+        {
+            if (piece == PAWN && (ranks == 1 || ranks == 8))
+                return 0;
+            kings[color(fen[i])] += piece == KING;
+            ++pieces;
+            ++sqrs;
+        }
+        else
+            return 0;
+
+        if (sqrs > 8 * ranks)
+            return 0;
+    }
+    if (ranks != 8 || sqrs != 64 || pieces > 32 || kings[BLACK] != 1 || kings[WHITE] != 1)
+        return 0;
+
+    const char stm = fen[++i];
+    if ((stm != 'w' && stm != 'b') || fen[++i] != ' ')
+        return 0;
+
+    if (fen[++i] == '-')
+        ++i;
+    else
+    {
+        const int start = i;
+        while (fen[i] == 'K' || fen[i] == 'Q' || fen[i] == 'k' || fen[i] == 'q')
+            ++i;
+        if (i == start)
+            return 0;
+    }
+    if (fen[i] != ' ')
+        return 0;
+
+    //Any sqr, the files written by older versions have the one of the pawn
+    if (fen[++i] == '-')
+        return 1;
+    return fen[i] >= 'a' && fen[i] <= 'h' && fen[i+1] >= '1' && fen[i+1] <= '8';
+}
+
 const Board defaultBoard()
 {
     Board b = (Board) {};
@@ -174,6 +234,7 @@ const Board defaultBoard()
     b.castleInfo = 0xf;
     b.allPieces = INITIAL_WPIECES | INITIAL_BPIECES;
     b.stm = WHITE;
+    computePSQT(&b);
 
     return b;
 }
@@ -249,5 +310,9 @@ int boardIsOK(const Board* b)
         ok &= ~b->color[c] == b->color[2|c];
     }
 
+    Board scratch = *b;
+    computePSQT(&scratch);
+    ok &= scratch.psqt[0] == b->psqt[0] && scratch.psqt[1] == b->psqt[1];
+
     return ok;
 }
\ No newline at end of file
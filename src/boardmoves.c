@@ -9,6 +9,7 @@
 #include "../include/moves.h"
 #include "../include/magic.h"
 #include "../include/boardmoves.h"
+#include "../include/evaluation.h"
 
 #include <assert.h>
 
@@ -42,11 +43,26 @@ inline static int rookMoved(const int color, const int from)
     return 0b1111;
 }
 
+/* Every change of the board goes through here, the piece is added to psqt if it appears
+ * and removed if it disappears, so undoing the move restores it
+ */
 inline static void flipBits(Board* b, const uint64_t from, const int piece, const int color)
 {
     b->piece[color][piece]  ^= from;
     b->color[color]         ^= from;
     b->color[color | 2]     ^= from;
+
+    const int* val = PSQT[color][piece][LSB_INDEX(from)];
+    if (b->piece[color][piece] & from)
+    {
+        b->psqt[0] += val[0];
+        b->psqt[1] += val[1];
+    }
+    else
+    {
+        b->psqt[0] -= val[0];
+        b->psqt[1] -= val[1];
+    }
 }
 
 /* Flips the necessary bits for castling
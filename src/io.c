@@ -176,8 +176,10 @@ void generateFen(const Board b, char* fen)
 
     if (b.enPass)
     {
-        fen[counter++] = 'h' - (b.enPass % 8);
-        fen[counter++] = '1' + (b.enPass / 8);
+        //enPass is the pawn that can be captured, the fen has the square behind it (as genFromFen expects)
+        const int target = b.enPass + (2 * b.stm - 1) * 8;
+        fen[counter++] = (char)('h' - (target % 8));
+        fen[counter++] = (char)('1' + (target / 8));
     }
     else
         fen[counter++] = '-';
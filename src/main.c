@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "../include/global.h"
@@ -21,6 +22,7 @@
 #include "../include/sort.h"
 #include "../include/movegen.h"
 #include "../include/nnue.h"
+#include "../include/nnuekernels.h"
 #ifdef USE_TB
 #include "../include/gaviota.h"
 #endif
@@ -28,7 +30,7 @@
 #include "../include/train.h"
 #endif
 
-#ifndef NNUE_PATH
+#if !defined(NNUE_PATH) && !defined(NNUE_EMBED)
 #define NNUE_PATH "/home/j/Desktop/Chess/Engine/nn-f4838ada61cc.nnue"
 #endif
 
@@ -46,6 +48,7 @@ int main(const int argc, char** const argv)
     initMemo();
     initMagics();
     initializeTable();
+    initEval();
 
     #ifdef TRAIN
     setVariables(argc, argv);
@@ -54,12 +57,23 @@ int main(const int argc, char** const argv)
     exit(EXIT_SUCCESS);
     #endif
 
-    initEval();
     initSort();
 
+    initKernels();
     #ifdef USE_NNUE
+    #ifdef NNUE_PATH
     initNNUE(NNUE_PATH);
+    #else
+    initNNUE(NULL);
     #endif
+    #endif
+
+    //noc evalfens [threads] < fens
+    if (argc > 1 && strcmp(argv[1], "evalfens") == 0)
+    {
+        evalFens(argc > 2? atoi(argv[2]) : 0);
+        exit(EXIT_SUCCESS);
+    }
 
     #ifdef USE_TB
     if (argc > 1)
@@ -2,6 +2,18 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "../include/global.h"
 #include "../include/board.h"
@@ -9,19 +21,67 @@
 #include "../include/boardmoves.h"
 #include "../include/nnue.h"
 #include "../include/nnuearch.h"
+#include "../include/nnuekernels.h"
 
-#define CHECK_READ(read,correct) if (read != correct) {fprintf(stderr, "Unsuccessful read in %s %d\n", __FILE__, __LINE__); \
-                                exit(5);}
-
-void readHeaders(FILE* f);
-void readParams(FILE* f, NNUE* nn);
-void readWeights(FILE* f, weight_t* nn, const int dims, const int isOutput);
+NNUEArch readHeaders(const uint8_t* data, const size_t size);
+int readNetwork(const uint8_t* data, NNUE* nn);
+const uint8_t* readWeights(const uint8_t* src, weight_t* ws, const int dims, const int isOutput);
 void showNNUE(const NNUE* nn);
 
-const uint32_t FTHeader = 0x5d69d7b8;
-const uint32_t NTHeader = 0x63337156;
-const uint32_t NNUEHash = 0x3e5aa6eeU;
-const int ArchSize = 177;
+//Sizes of the feature transformer that can be loaded, from the biggest, the smaller ones are faster nets
+static const int SupportedArchs[] = {256, 128};
+
+//Hashes of the layers as sf computes them
+static uint32_t affineHash(const uint32_t prev, const uint32_t outputs)
+{
+    uint32_t h = 0xCC03DAE4u + outputs;
+    h ^= prev >> 1;
+    h ^= prev << 31;
+    return h;
+}
+
+static uint32_t reluHash(const uint32_t prev)
+{
+    return 0x538D24C7u + prev;
+}
+
+static uint32_t ftHash(const int halfDims)
+{
+    return 0x5D69D5B8u ^ (uint32_t)(2*halfDims);
+}
+
+static uint32_t networkHash(const int halfDims)
+{
+    const uint32_t input = 0xEC42E90Du ^ (uint32_t)(2*halfDims);
+    const uint32_t hidden1 = reluHash(affineHash(input, 32));
+    const uint32_t hidden2 = reluHash(affineHash(hidden1, 32));
+    return affineHash(hidden2, 1);
+}
+
+/* Layout of the file, the feature transformer is stored as it is used:
+ * version, hash, archSize, description, ft hash, ft biases, ft weights, network hash, layers
+ */
+static NNUEArch makeArch(const int halfDims, const uint32_t archSize)
+{
+    NNUEArch arch = {.halfDims = halfDims, .hash = ftHash(halfDims) ^ networkHash(halfDims), .archSize = archSize};
+    arch.ftOffset = 3*sizeof(uint32_t) + archSize + sizeof(uint32_t);
+    arch.ftSize = sizeof(int16_t)*(size_t)(halfDims*(1 + kInputDimensionsFT));
+    arch.networkOffset = arch.ftOffset + arch.ftSize;
+    arch.networkSize = sizeof(uint32_t)
+        + 32*sizeof(int32_t) + (size_t)(32*2*halfDims)
+        + 32*sizeof(int32_t) + 32*32
+        + sizeof(int32_t) + 32;
+    arch.fileSize = arch.networkOffset + arch.networkSize;
+    return arch;
+}
+
+#ifdef NNUE_EMBED
+/* Default net, included in the binary by nnueembed.c. The weights of the feature transformer are
+ * aligned, so they are used from the read only data of the binary, which every process running it shares
+ */
+extern const uint8_t embeddedNNUE[];
+extern const uint8_t embeddedNNUEEnd[];
+#endif
 
 enum {
   PS_W_PAWN   =  1,
@@ -46,154 +106,448 @@ const uint32_t PieceToIndex[2][16] = {
 
 
 static NNUE nnue;
-static int16_t nInput[kDimensionFT];
+//The one of the search
+static NNUEEvaluator mainEvaluator;
 
+#ifdef NNUE_SHARED
+//So that the last engine that exits removes the shared segment
+static void releaseNNUE(void)
+{
+    freeNNUE(&nnue);
+    nnue = (NNUE) {};
+}
+#endif
+
+//The old net is only freed once the new one has been loaded, path NULL is the embedded net
 void initNNUE(const char* path)
 {
+    #ifdef NNUE_SHARED
+    static int registered = 0;
+    if (!registered)
+        registered = !atexit(releaseNNUE);
+    #endif
+
+    NNUE old = nnue;
     nnue = loadNNUE(path);
+    freeNNUE(&old);
+    initEvaluator(&mainEvaluator, &nnue);
 }
 
-NNUE loadNNUE(const char* path)
+const NNUE* loadedNNUE(void)
 {
-    assert(sizeof(uint32_t) == 4);
-    assert(dimensions[2] == dimensions[3]);
-    assert(dimensions[2] == kDimensionHidden);
-    assert(kHalfDimensionFT == dimensions[1] / 2);
-    assert(kHalfDimensionFT == kDimensionFT / 2);
+    return &nnue;
+}
 
-    NNUE nn = (NNUE) {};
+/* Net loaded in the background, it replaces nnue in swapNNUE, between searches. The search
+ * only reads nnue, so it doesn't matter how long the load takes
+ * loadState -> Written by the thread that loads it once nextNNUE is complete
+ */
+enum {LOAD_IDLE, LOAD_RUNNING, LOAD_DONE, LOAD_FAILED};
+static NNUE nextNNUE;
+static int loadState = LOAD_IDLE;
+static pthread_t loadThread;
 
-    FILE* f = fopen(path, "r");
+static void* loadJob(void* arg)
+{
+    char* path = arg;
+    const int loaded = tryLoadNNUE(path, &nextNNUE);
+    fflush(stdout);
+    free(path);
+    __atomic_store_n(&loadState, loaded? LOAD_DONE : LOAD_FAILED, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    if (!f)
+/* Starts loading the net at path in another thread, the current one is used until it is swapped.
+ * If it isn't valid the current one is kept
+ */
+void loadNNUEAsync(const char* path)
+{
+    swapNNUE(0);
+    if (__atomic_load_n(&loadState, __ATOMIC_ACQUIRE) != LOAD_IDLE)
     {
-        fprintf(stderr, "Can't open nnue file: %s\n", path);
-        exit(5);
+        fprintf(stderr, "A NNUE is already being loaded, %s is ignored\n", path);
+        return;
     }
 
-    #ifdef NNUE_DEBUG
-        printf("Loading NNUE %s\n", path);
-    #endif
+    char* copy = strdup(path);
+    CHECK_MALLOC(copy);
+    loadState = LOAD_RUNNING;
+    if (pthread_create(&loadThread, NULL, loadJob, copy))
+    {
+        //Without threads it is loaded now
+        loadState = LOAD_IDLE;
+        free(copy);
+        NNUE nn;
+        if (tryLoadNNUE(path, &nn))
+        {
+            nextNNUE = nn;
+            loadState = LOAD_DONE;
+        }
+        swapNNUE(0);
+    }
+}
 
-    nn.ftBiases = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT);
-    nn.ftWeights = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT*kInputDimensionsFT);
-    CHECK_MALLOC(nn.ftBiases);
-    CHECK_MALLOC(nn.ftWeights);
+/* Uses the net loaded by loadNNUEAsync if it has finished, it can't be called during a search.
+ * The accumulators of the search are refreshed with the new net and the old one is freed
+ * wait -> Waits for the load if it is still running
+ * Returns 1 if the net has changed
+ */
+int swapNNUE(const int wait)
+{
+    int state = __atomic_load_n(&loadState, __ATOMIC_ACQUIRE);
+    if (state == LOAD_IDLE || (state == LOAD_RUNNING && !wait))
+        return 0;
+
+    pthread_join(loadThread, NULL);
+    state = loadState;
+    loadState = LOAD_IDLE;
+    if (state == LOAD_FAILED)
+        return 0;
+
+    NNUE old = nnue;
+    nnue = nextNNUE;
+    nextNNUE = (NNUE) {};
+    freeNNUE(&old);
+    initEvaluator(&mainEvaluator, &nnue);
+    return 1;
+}
 
-    readHeaders(f);
-    readParams(f, &nn);
+static int checkHeader(const uint32_t read, const uint32_t expected, const char* name)
+{
+    if (read != expected)
+    {
+        fprintf(stderr, "Wrong NNUE %s: %x instead of %x\n", name, read, expected);
+        return 0;
+    }
+    return 1;
+}
 
-    fclose(f);
+#ifdef NNUE_SHARED
+enum {SharedHeaderSize = 64};
 
-    #ifdef NNUE_DEBUG
-    if (0)
-        showNNUE(&nn);
-    #endif
-
-    printf("%s NNUE loaded\n", path);
+static uint64_t hashNet(const uint8_t* data, const size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+    for (size_t i = 0; i + 8 <= size; i += 8)
+    {
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    return h;
+}
 
-    return nn;
+/* The feature transformer is copied once into a shared memory segment named after the hash of the net,
+ * the rest of the processes that load the same net map it read only. Every process that uses it holds
+ * a shared flock on the segment, the kernel drops it if the process dies, so the last one that detaches
+ * (the only one that can get the exclusive lock) unlinks it. The creator holds the exclusive lock while it copies
+ * The first 64 bytes of the segment are a flag set once the copy is complete and the hash of the net
+ */
+static void sharedName(char* name, const uint64_t hash)
+{
+    sprintf(name, "/noc-nnue-%016lx", (unsigned long)hash);
 }
 
-void readHeaders(FILE* f)
+static int shareFT(const uint8_t* data, NNUE* nn)
 {
-    uint32_t version, hash;
-    int successfulRead = 1, size;
+    char name[64];
+    const NNUEArch* arch = &nn->arch;
+    const uint64_t hash = hashNet(data, arch->fileSize);
+    sharedName(name, hash);
+    const size_t size = SharedHeaderSize + arch->ftSize;
+    const struct timespec ms = {.tv_sec = 0, .tv_nsec = 1000000};
+
+    uint8_t* segment;
+    int fd;
+    //The second try is after removing a stale segment
+    for (int tries = 0; ; ++tries)
+    {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0)
+        {
+            if (flock(fd, LOCK_EX) || ftruncate(fd, (off_t)size))
+            {
+                close(fd);
+                shm_unlink(name);
+                return 0;
+            }
+            segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (segment == MAP_FAILED)
+            {
+                shm_unlink(name);
+                close(fd);
+                return 0;
+            }
 
-    successfulRead &= fread(&version, sizeof(uint32_t), 1, f);
-    successfulRead &= fread(&hash, sizeof(uint32_t), 1, f);
-    successfulRead &= fread(&size, sizeof(uint32_t), 1, f);
+            memcpy(segment + SharedHeaderSize, data + arch->ftOffset, arch->ftSize);
+            memcpy(segment + 8, &hash, sizeof(hash));
+            __atomic_store_n((uint32_t*)segment, 1, __ATOMIC_RELEASE);
+            mprotect(segment, size, PROT_READ);
+            flock(fd, LOCK_SH);
+            break;
+        }
 
-    assert(version == NNUEVersion);
-    assert(hash == NNUEHash);
-    assert(size == ArchSize);
-    CHECK_READ(successfulRead, 1);
+        fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+            return 0;
 
-    char* architecture = (char*)malloc(ArchSize);
-    CHECK_MALLOC(architecture);
+        //Waits up to 5s for the process that creates it
+        struct stat st;
+        int ready = 0;
+        segment = MAP_FAILED;
+        for (int i = 0; i < 5000 && !ready; ++i)
+        {
+            if (segment == MAP_FAILED && !fstat(fd, &st) && (size_t)st.st_size >= size)
+                segment = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            ready = segment != MAP_FAILED && __atomic_load_n((uint32_t*)segment, __ATOMIC_ACQUIRE);
+            if (!ready)
+                nanosleep(&ms, NULL);
+        }
 
-    successfulRead = fread(architecture, sizeof(char), ArchSize, f);
-    CHECK_READ(successfulRead, ArchSize);
+        if (ready && !flock(fd, LOCK_SH))
+            break;
 
-    #ifdef NNUE_DEBUG
-        printf("Version: %u\n", version);
-        printf("Hash: %u\n", hash);
-        printf("Size: %u\n", size);
-        printf("Architecture: %s\n", architecture);
-    #endif
+        if (segment != MAP_FAILED)
+            munmap(segment, size);
+        //Stale: the copy isn't complete but nobody holds the lock, the creator died midway
+        const int stale = !ready && !flock(fd, LOCK_EX | LOCK_NB);
+        if (stale)
+        {
+            fprintf(stderr, "Replacing the stale shared NNUE %s\n", name);
+            shm_unlink(name);
+        }
+        close(fd);
+        if (!stale || tries)
+            return 0;
+    }
 
-    free(architecture);
+    nn->ftBiases = (int16_t*)(segment + SharedHeaderSize);
+    nn->ftWeights = nn->ftBiases + arch->halfDims;
+    nn->ftStorage = FT_SHARED;
+    nn->ftMapping = segment;
+    nn->ftMappingSize = size;
+    nn->ftFd = fd;
+    return 1;
 }
 
-//Code copied from evaluate_nnue
-void readParams(FILE* f, NNUE* nn)
+/* Drops the lock of the process, if nobody else uses the segment it is removed. If it
+ * has already been unlinked (and maybe replaced by another one with the same name) it is only closed
+ */
+static void unshareFT(NNUE* nn)
 {
-    uint32_t header;
-    int successfulRead = 1;
+    char name[64];
+    uint64_t hash;
+    memcpy(&hash, (uint8_t*)nn->ftMapping + 8, sizeof(hash));
+    sharedName(name, hash);
+    munmap(nn->ftMapping, nn->ftMappingSize);
+
+    struct stat st;
+    if (!flock(nn->ftFd, LOCK_EX | LOCK_NB) && !fstat(nn->ftFd, &st) && st.st_nlink > 0)
+        shm_unlink(name);
+    close(nn->ftFd);
+}
+#endif
+
+/* The net is validated and the network is moved to the layout of the backend,
+ * the feature transformer is used from data if it can be (the embedded net) or shared, else it is copied
+ * size -> Bytes of data, it has to be the size of the architecture in the header
+ * Returns 0 if the net isn't valid, out isn't modified then
+ */
+static int parseNNUE(const uint8_t* data, const size_t size, const int persistent, NNUE* out)
+{
+    assert(sizeof(uint32_t) == 4);
+    assert(dimensions[2] == dimensions[3]);
+    assert(dimensions[2] == kDimensionHidden);
+    assert(kHalfDimensionFT == dimensions[1] / 2);
+    assert(kHalfDimensionFT == kDimensionFT / 2);
 
-    //First read the feature transformer
+    NNUE nn = (NNUE) {};
 
-    successfulRead = fread(&header, sizeof(uint32_t), 1, f);
-    CHECK_READ(successfulRead, 1);
-    assert(header == FTHeader);
+    nn.arch = readHeaders(data, size);
+    if (!nn.arch.halfDims || !readNetwork(data + nn.arch.networkOffset, &nn))
+        return 0;
 
-    #ifdef NNUE_DEBUG
-        printf("Header_FT: %u\n", header);
+    const int halfDims = nn.arch.halfDims;
+    if (persistent && ((uintptr_t)(data + nn.arch.ftOffset) & 63) == 0)
+    {
+        nn.ftBiases = (int16_t*)(data + nn.arch.ftOffset);
+        nn.ftWeights = nn.ftBiases + halfDims;
+        nn.ftStorage = FT_EMBEDDED;
+        *out = nn;
+        return 1;
+    }
+
+    #ifdef NNUE_SHARED
+    if (shareFT(data, &nn))
+    {
+        *out = nn;
+        return 1;
+    }
     #endif
 
-    successfulRead = fread(nn->ftBiases, sizeof(nn->ftBiases[0]), kHalfDimensionFT, f);
-    CHECK_READ(successfulRead, kHalfDimensionFT);
+    nn.ftBiases = (int16_t*)malloc(sizeof(int16_t)*(size_t)halfDims);
+    nn.ftWeights = (int16_t*)malloc(sizeof(int16_t)*(size_t)(halfDims*kInputDimensionsFT));
+    CHECK_MALLOC(nn.ftBiases);
+    CHECK_MALLOC(nn.ftWeights);
+    memcpy(nn.ftBiases, data + nn.arch.ftOffset, sizeof(int16_t)*(size_t)halfDims);
+    memcpy(nn.ftWeights, data + nn.arch.ftOffset + sizeof(int16_t)*(size_t)halfDims, sizeof(int16_t)*(size_t)(halfDims*kInputDimensionsFT));
+    nn.ftStorage = FT_MALLOC;
 
-    successfulRead = fread(nn->ftWeights, sizeof(nn->ftWeights[0]), kHalfDimensionFT*kInputDimensionsFT, f);
-    CHECK_READ(successfulRead, kHalfDimensionFT*kInputDimensionsFT);
+    *out = nn;
+    return 1;
+}
 
+/* The file is mapped and parsed in place, path NULL is the embedded net
+ * Returns 0 if it can't be loaded, the reason is written to stderr
+ */
+int tryLoadNNUE(const char* path, NNUE* nn)
+{
+    if (!path)
+    {
+        #ifdef NNUE_EMBED
+        if (!parseNNUE(embeddedNNUE, embeddedNNUEEnd - embeddedNNUE, 1, nn))
+            return 0;
+        printf("Embedded NNUE loaded (2x%d)\n", nn->arch.halfDims);
+        return 1;
+        #else
+        fprintf(stderr, "There isn't an embedded NNUE, compile with NNUE_EMBED=<path>\n");
+        return 0;
+        #endif
+    }
+
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Can't open nnue file: %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    //Enough for the headers, the size of the architecture is checked once it is known
+    if (st.st_size < 256)
+    {
+        fprintf(stderr, "%s isn't a NNUE net, it only has %ld bytes\n", path, (long)st.st_size);
+        close(fd);
+        return 0;
+    }
+    const size_t size = (size_t)st.st_size;
+
+    #ifdef NNUE_DEBUG
+        printf("Loading NNUE %s\n", path);
+    #endif
 
-    //Now read the network
+    const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Can't map nnue file: %s\n", path);
+        return 0;
+    }
 
-    successfulRead = fread(&header, sizeof(uint32_t), 1, f);
-    CHECK_READ(successfulRead, 1);
-    assert(header == NTHeader);
+    const int valid = parseNNUE(data, size, 0, nn);
+    munmap((void*)data, size);
+    if (!valid)
+        return 0;
 
     #ifdef NNUE_DEBUG
-        printf("Header_Network: %u\n", header);
+    if (0)
+        showNNUE(nn);
     #endif
 
-    successfulRead = fread(nn->biases1, sizeof(nn->biases1[0]), dimensions[2], f);
-    CHECK_READ(successfulRead, dimensions[3]);
-    readWeights(f, nn->weights1, dimensions[1], 0);
+    printf("%s NNUE loaded (2x%d)\n", path, nn->arch.halfDims);
+
+    return 1;
+}
+
+//Same as tryLoadNNUE, but the engine can't go on without the net
+NNUE loadNNUE(const char* path)
+{
+    NNUE nn;
+    if (!tryLoadNNUE(path, &nn))
+        exit(5);
+    return nn;
+}
 
-    successfulRead = fread(nn->biases2, sizeof(nn->biases2[0]), dimensions[3], f);
-    CHECK_READ(successfulRead, dimensions[3]);
-    readWeights(f, nn->weights2, dimensions[2], 0);
+/* The architecture is the one whose hash is in the header, the description string
+ * isn't used because trainers write anything there. Its halfDims is 0 if the net isn't valid
+ */
+NNUEArch readHeaders(const uint8_t* data, const size_t size)
+{
+    uint32_t header[3];
+    memcpy(header, data, sizeof(header));
 
-    successfulRead = fread(nn->outputB, sizeof(nn->outputB[0]), dimensions[4], f);
-    CHECK_READ(successfulRead, dimensions[4]);
-    readWeights(f, nn->outputW, 1, 1);
+    NNUEArch arch = {.halfDims = 0};
+    if (!checkHeader(header[0], NNUEVersion, "version"))
+        return arch;
 
-    int ignore, cnt = 0;
-    while (fread(&ignore, sizeof(int), 1, f))
-        cnt++;
-    if (cnt)
+    for (size_t i = 0; i < sizeof(SupportedArchs) / sizeof(SupportedArchs[0]); ++i)
+        if (makeArch(SupportedArchs[i], header[2]).hash == header[1])
+            arch = makeArch(SupportedArchs[i], header[2]);
+    if (!arch.halfDims)
     {
-        fprintf(stderr, "NNUE file hasn't been read completely, %d ints remeain\n", cnt);
-        exit(10);
+        fprintf(stderr, "Unsupported NNUE architecture, hash %x, only HalfKP 2x256 and 2x128 with 32-32-1 can be loaded\n", header[1]);
+        return arch;
     }
+    if (arch.fileSize != size)
+    {
+        fprintf(stderr, "Wrong NNUE size for HalfKP 2x%d: %lu bytes instead of %lu\n", arch.halfDims, (unsigned long)size, (unsigned long)arch.fileSize);
+        return (NNUEArch) {.halfDims = 0};
+    }
+
+    uint32_t ftHeader;
+    memcpy(&ftHeader, data + arch.ftOffset - sizeof(uint32_t), sizeof(uint32_t));
+    if (!checkHeader(ftHeader, ftHash(arch.halfDims), "feature transformer header"))
+        return (NNUEArch) {.halfDims = 0};
+
+    #ifdef NNUE_DEBUG
+        printf("Version: %u\n", header[0]);
+        printf("Hash: %u\n", header[1]);
+        printf("Size: %u\n", header[2]);
+        printf("Architecture: %.*s\n", (int)header[2], (const char*)data + sizeof(header));
+    #endif
+
+    return arch;
 }
 
-void readWeights(FILE* f, weight_t* ws, const int dims, const int isOutput)
+//Code copied from evaluate_nnue, returns 0 if the header of the network is wrong
+int readNetwork(const uint8_t* data, NNUE* nn)
+{
+    uint32_t header;
+    const uint8_t* p = data;
+    memcpy(&header, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    if (!checkHeader(header, networkHash(nn->arch.halfDims), "network header"))
+        return 0;
+
+    memcpy(nn->biases1, p, sizeof(nn->biases1));
+    p += sizeof(nn->biases1);
+    p = readWeights(p, nn->weights1, 2*nn->arch.halfDims, 0);
+
+    memcpy(nn->biases2, p, sizeof(nn->biases2));
+    p += sizeof(nn->biases2);
+    p = readWeights(p, nn->weights2, dimensions[2], 0);
+
+    memcpy(nn->outputB, p, sizeof(nn->outputB));
+    p += sizeof(nn->outputB);
+    p = readWeights(p, nn->outputW, 1, 1);
+
+    assert(p == data + nn->arch.networkSize);
+    return 1;
+}
+
+//Moves the weights of a layer from the file to the layout of the backend, returns the end of the layer
+const uint8_t* readWeights(const uint8_t* src, weight_t* ws, const int dims, const int isOutput)
 {
     for (int i = 0; i < 32; ++i)
     {
         for (int j = 0; j < dims; ++j)
         {
-            int8_t a;
-            int s = fread(&a, 1, 1, f);
-            CHECK_READ(s, 1);
             //Output is the same whether it is sparse or regular
-            int idx = isOutput? i*dims+j : getIdx(i,j,dims);
-            ws[idx] = (weight_t)a;
+            const int idx = isOutput? i*dims+j : getIdx(i,j,dims);
+            ws[idx] = (weight_t)(int8_t)src[i*dims+j];
         }
     }
+    return src + 32*dims;
 }
 
 //TODO: make this a "save nn into binary file" function
@@ -204,13 +558,13 @@ void showNNUE(const NNUE* nn)
 
     //Input will be needed
     //FT
-    for (int i = 0; i < kHalfDimensionFT; ++i)
+    for (int i = 0; i < nn->arch.halfDims; ++i)
     {
         printf("%d, ", nn->ftBiases[i]);
     }
     printf("\n");
 
-    for (int i = 0; i < kHalfDimensionFT*kInputDimensionsFT; ++i)
+    for (int i = 0; i < nn->arch.halfDims*kInputDimensionsFT; ++i)
     {
         printf("%d, ", nn->ftWeights[i]);
     }
@@ -222,7 +576,7 @@ void showNNUE(const NNUE* nn)
         printf("%d, ", nn->biases1[i]);
     }
     printf("\n");
-    for (int i = 0; i < kDimensionFT*32; ++i)
+    for (int i = 0; i < 2*nn->arch.halfDims*32; ++i)
     {
         printf("%d, ", nn->weights1[i]);
     }
@@ -251,8 +605,15 @@ void showNNUE(const NNUE* nn)
 
 void freeNNUE(NNUE* nn)
 {
-    free(nn->ftBiases);
-    free(nn->ftWeights);
+    if (nn->ftStorage == FT_MALLOC)
+    {
+        free(nn->ftBiases);
+        free(nn->ftWeights);
+    }
+    #ifdef NNUE_SHARED
+    else if (nn->ftStorage == FT_SHARED)
+        unshareFT(nn);
+    #endif
 }
 
 static inline const int makeIndex(const int c, const int sq, const int pc, const int ksq)
@@ -267,15 +628,18 @@ static inline const int toSf(const int c, const int sq)
     return (7 ^ sq) ^ (c? 0 : 0x3f);
 }
 
+static inline const int16_t* ftRow(const NNUE* nn, const int idx)
+{
+    return nn->ftWeights + nn->arch.halfDims * idx;
+}
+
 //Calculates the input layer for a given color (king-piece, king is of color)
 void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t* inp)
 {
     assert(POPCOUNT(b->allPieces) <= 32);
-    int actives[30];
+    const int16_t* actives[30];
     int numActives = 0;
 
-    memcpy(inp, nn->ftBiases, sizeof(int16_t)*kHalfDimensionFT);
-
     int ksq = toSf(color, LSB_INDEX(b->piece[color][KING]));
 
     for (int c = BLACK; c <= WHITE; ++c)
@@ -287,7 +651,7 @@ void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t*
             while (bb)
             {
                 int sq = toSf(color, LSB_INDEX(bb));
-                actives[numActives++] = makeIndex(color, sq, sfPc, ksq);
+                actives[numActives++] = ftRow(nn, makeIndex(color, sq, sfPc, ksq));
                 REMOVE_LSB(bb);
             }
         }
@@ -295,23 +659,100 @@ void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t*
 
     assert(numActives == POPCOUNT(b->allPieces)-2);
 
-    for (int i = 0; i < numActives; ++i)
+    ftUpdate(inp, nn->ftBiases, actives, numActives, NULL, 0, nn->arch.halfDims);
+}
+
+/* The evaluator has to be initialized again when its net changes
+ */
+void initEvaluator(NNUEEvaluator* ev, const NNUE* nn)
+{
+    ev->nn = nn;
+    ev->accIdx = 0;
+    ev->accStack[0].computed[WHITE] = ev->accStack[0].computed[BLACK] = 0;
+
+    for (int color = BLACK; color <= WHITE; ++color)
     {
-        const int offset = kHalfDimensionFT * actives[i];
-        for (int j = 0; j < kHalfDimensionFT; ++j)
-            inp[j] += nn->ftWeights[offset+j];
+        for (int sqr = 0; sqr < 64; ++sqr)
+        {
+            memcpy(ev->finny[color][sqr].acc, nn->ftBiases, sizeof(int16_t)*(size_t)nn->arch.halfDims);
+            memset(ev->finny[color][sqr].piece, 0, sizeof(ev->finny[color][sqr].piece));
+        }
     }
 }
 
+NNUEEvaluator* newEvaluator(const NNUE* nn)
+{
+    NNUEEvaluator* ev = malloc(sizeof(NNUEEvaluator));
+    CHECK_MALLOC(ev);
+    initEvaluator(ev, nn);
+    return ev;
+}
+
+void freeEvaluator(NNUEEvaluator* ev)
+{
+    free(ev);
+}
+
+/* Same result as inputLayer, but it starts from the last refresh with the king in the same sqr
+ */
+static void refreshAccumulator(NNUEEvaluator* ev, const Board* const b, const int color, int16_t* inp)
+{
+    const NNUE* nn = ev->nn;
+    const int kingSqr = LSB_INDEX(b->piece[color][KING]);
+    const int ksq = toSf(color, kingSqr);
+    FinnyEntry* entry = &ev->finny[color][kingSqr];
+
+    const int16_t* added[30];
+    const int16_t* removed[30];
+    int numAdded = 0, numRemoved = 0;
+
+    for (int c = BLACK; c <= WHITE; ++c)
+    {
+        for (int piece = QUEEN; piece <= PAWN; ++piece)
+        {
+            const int sfPc = (c==WHITE? 6 : 14) - piece;
+            uint64_t rem = entry->piece[c][piece] & ~b->piece[c][piece];
+            uint64_t add = b->piece[c][piece] & ~entry->piece[c][piece];
+
+            while (rem)
+            {
+                removed[numRemoved++] = ftRow(nn, makeIndex(color, toSf(color, LSB_INDEX(rem)), sfPc, ksq));
+                REMOVE_LSB(rem);
+            }
+            while (add)
+            {
+                added[numAdded++] = ftRow(nn, makeIndex(color, toSf(color, LSB_INDEX(add)), sfPc, ksq));
+                REMOVE_LSB(add);
+            }
+
+            entry->piece[c][piece] = b->piece[c][piece];
+        }
+    }
+
+    assert(numAdded <= 30 && numRemoved <= 30);
+    ftUpdate(entry->acc, entry->acc, added, numAdded, removed, numRemoved, nn->arch.halfDims);
+    memcpy(inp, entry->acc, sizeof(int16_t)*(size_t)nn->arch.halfDims);
+}
+
 void determineChanges(const Move m, NNUEChangeList* list, const int color)
 {
-    //If a KING moves, we have to reset everything
+    //The king isn't an input, but all the inputs of its perspective depend on its sqr
     if (m.piece == KING)
     {
-        list->changes[0].piece = KING;
-        list->idx = 1;
+        list->refresh = color;
+
+        if (m.castle)
+        {
+            const int rookFrom = (m.castle & 1)? m.to - 1 : m.to + 2;
+            const int rookTo = (m.castle & 1)? m.to + 1 : m.to - 1;
+            list->changes[list->idx++] = (NNUEChange) {.piece = ROOK, .sqr = rookFrom, .color = color, .appears = 0};
+            list->changes[list->idx++] = (NNUEChange) {.piece = ROOK, .sqr = rookTo, .color = color, .appears = 1};
+        }
+        else if (IS_CAP(m)) //Quiet king moves can have capture == -1
+            list->changes[list->idx++] = (NNUEChange) {.piece = m.capture, .sqr = m.to, .color = 1^color, .appears = 0};
         return;
     }
+    list->refresh = -1;
 
     //Removing the piece from the current sqr
     list->changes[list->idx++] = (NNUEChange) {.piece = m.piece, .sqr = m.from, .color = color, .appears = 0};
@@ -327,75 +768,398 @@ void determineChanges(const Move m, NNUEChangeList* list, const int color)
         list->changes[list->idx++] = (NNUEChange) {.piece = PAWN, .sqr = m.enPass, .color = 1^color, .appears = 0};
 }
 
-void applyChanges(const NNUE* nn, const Board* b, const NNUEChangeList* list, const int color, int16_t* inp)
+/* Writes in inp the accumulator prev after applying the changes, both can be the same buffer
+ */
+static void applyChangesFrom(const NNUE* nn, const Board* b, const NNUEChangeList* list, const int color, const int16_t* prev, int16_t* inp)
 {
-    if (list->changes[0].piece == KING)
+    if (list->refresh == color)
     {
         inputLayer(nn, b, color, inp);
         return;
     }
 
     const int ksq = toSf(color, LSB_INDEX(b->piece[color][KING]));
+    const int16_t* added[4];
+    const int16_t* removed[4];
+    int numAdded = 0, numRemoved = 0;
 
     for (int i = 0; i < list->idx; ++i)
     {
         const int c = list->changes[i].color;
         const int sfPc = (c?6:14) - list->changes[i].piece;
         const int sq = toSf(color, list->changes[i].sqr);
-        const int offset = kHalfDimensionFT * makeIndex(color, sq, sfPc, ksq);
 
         if (list->changes[i].appears)
+            added[numAdded++] = ftRow(nn, makeIndex(color, sq, sfPc, ksq));
+        else
+            removed[numRemoved++] = ftRow(nn, makeIndex(color, sq, sfPc, ksq));
+    }
+
+    ftUpdate(inp, prev, added, numAdded, removed, numRemoved, nn->arch.halfDims);
+}
+void applyChanges(const NNUE* nn, const Board* b, const NNUEChangeList* list, const int color, int16_t* inp)
+{
+    applyChangesFrom(nn, b, list, color, inp, inp);
+}
+
+void evaluatorSetPosition(NNUEEvaluator* ev, const Board* b)
+{
+    ev->accIdx = 0;
+    refreshAccumulator(ev, b, WHITE, ev->accStack[0].acc);
+    refreshAccumulator(ev, b, BLACK, ev->accStack[0].acc + kHalfDimensionFT);
+    ev->accStack[0].computed[WHITE] = ev->accStack[0].computed[BLACK] = 1;
+}
+
+/* Only the changes are stored, the accumulator is computed once the position is evaluated
+ * b -> Position after the move has been made
+ */
+void evaluatorDo(NNUEEvaluator* ev, const Move m, const Board* b)
+{
+    assert(ev->accIdx + 1 < ACC_STACK_SIZE);
+    NNUEAccumulator* acc = &ev->accStack[++ev->accIdx];
+
+    acc->dirty.idx = 0;
+    determineChanges(m, &acc->dirty, 1^b->stm);
+    acc->computed[WHITE] = acc->computed[BLACK] = 0;
+    assert(acc->dirty.idx < 5);
+}
+
+void evaluatorUndo(NNUEEvaluator* ev)
+{
+    assert(ev->accIdx > 0);
+    --ev->accIdx;
+}
+
+/* Brings the perspective color of the current ply up to date, the changes are applied from the
+ * last ply that is computed, if its king moved in between the accumulator is refreshed
+ */
+static void updateAccumulator(NNUEEvaluator* ev, const Board* b, const int color)
+{
+    NNUEAccumulator* accStack = ev->accStack;
+    const int accIdx = ev->accIdx;
+    if (accStack[accIdx].computed[color])
+        return;
+
+    const int offset = color == WHITE? 0 : kHalfDimensionFT;
+
+    int i = accIdx;
+    while (i > 0 && !accStack[i].computed[color] && accStack[i].dirty.refresh != color)
+        --i;
+
+    if (!accStack[i].computed[color])
+    {
+        refreshAccumulator(ev, b, color, accStack[accIdx].acc + offset);
+        accStack[accIdx].computed[color] = 1;
+        return;
+    }
+
+    //The king of color hasn't moved since ply i, so b has its sqr
+    for (++i; i <= accIdx; ++i)
+    {
+        applyChangesFrom(ev->nn, b, &accStack[i].dirty, color, accStack[i-1].acc + offset, accStack[i].acc + offset);
+        accStack[i].computed[color] = 1;
+    }
+}
+
+int evaluatorEval(NNUEEvaluator* ev, const Board* const b, const int useAcc)
+{
+    int score;
+    if (useAcc)
+    {
+        updateAccumulator(ev, b, WHITE);
+        updateAccumulator(ev, b, BLACK);
+        score = evaluateAcc(ev->nn, b, ev->accStack[ev->accIdx].acc);
+    }
+    else
+    {
+        int16_t input[kDimensionFT];
+        score = evaluate(ev->nn, b, input);
+    }
+    return score;
+}
+
+typedef struct
+{
+    const NNUE* nn;
+    const Board* boards;
+    int* scores;
+    int n;
+} BatchJob;
+
+enum {BATCH_BLOCK = 64};
+
+/* The accumulators of a block of positions are computed first and then the layers of all of them,
+ * so the rows of the feature transformer don't evict the weights of the layers between positions.
+ * The refreshes go through the Finny table, positions with the king in the same sqr only apply the difference
+ */
+static void* evaluateJob(void* arg)
+{
+    BatchJob* job = arg;
+    NNUEEvaluator* ev = newEvaluator(job->nn);
+    int16_t (*accs)[kDimensionFT] = malloc(sizeof(int16_t)*kDimensionFT*BATCH_BLOCK);
+    CHECK_MALLOC(accs);
+
+    for (int start = 0; start < job->n; start += BATCH_BLOCK)
+    {
+        const int size = job->n - start < BATCH_BLOCK? job->n - start : BATCH_BLOCK;
+        const Board* boards = job->boards + start;
+
+        for (int i = 0; i < size; ++i)
         {
-            for (int j = 0; j < kHalfDimensionFT; ++j)
-                inp[j] += nn->ftWeights[offset+j];
+            refreshAccumulator(ev, &boards[i], WHITE, accs[i]);
+            refreshAccumulator(ev, &boards[i], BLACK, accs[i] + kHalfDimensionFT);
         }
-        else
+        for (int i = 0; i < size; ++i)
+            job->scores[start + i] = evaluateAcc(job->nn, &boards[i], accs[i]);
+    }
+
+    free(accs);
+    freeEvaluator(ev);
+    return NULL;
+}
+
+/* Evaluates n positions, the same as evaluateNNUE(b, 0) for each one,
+ * they are split in consecutive chunks between the threads
+ */
+void evaluateBatch(const NNUE* nn, const Board* boards, int* scores, const int n, int threads)
+{
+    if (threads > n / BATCH_BLOCK)
+        threads = n / BATCH_BLOCK;
+    if (threads < 1)
+        threads = 1;
+
+    pthread_t threadId[threads];
+    BatchJob jobs[threads];
+    const int perThread = (n + threads - 1) / threads;
+
+    for (int i = 0; i < threads; ++i)
+    {
+        const int start = i * perThread;
+        const int end = start + perThread < n? start + perThread : n;
+        jobs[i] = (BatchJob) {.nn = nn, .boards = boards + start, .scores = scores + start, .n = end - start};
+    }
+
+    //The first chunk is evaluated by this thread, and so is any chunk whose thread can't be created
+    int started[threads];
+    for (int i = 1; i < threads; ++i)
+    {
+        started[i] = pthread_create(&threadId[i], NULL, evaluateJob, &jobs[i]) == 0;
+        if (!started[i])
+            evaluateJob(&jobs[i]);
+    }
+    evaluateJob(&jobs[0]);
+    for (int i = 1; i < threads; ++i)
+        if (started[i])
+            pthread_join(threadId[i], NULL);
+}
+
+#ifdef __linux__
+/* Hardware counter of the cache misses of this thread, -1 if the kernel doesn't allow it
+ * l1 -> Misses of the L1 data cache on reads, else the ones of the last level cache
+ */
+static int openCacheCounter(const int l1)
+{
+    struct perf_event_attr attr = {.size = sizeof(struct perf_event_attr), .disabled = 1, .exclude_kernel = 1, .exclude_hv = 1};
+    if (l1)
+    {
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+    else
+    {
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    }
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void startCounter(const int fd)
+{
+    if (fd < 0)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static int64_t stopCounter(const int fd)
+{
+    int64_t count = -1;
+    if (fd < 0)
+        return count;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    return count;
+}
+#else
+static int openCacheCounter(const int l1) { return -1; }
+static void startCounter(const int fd) {}
+static int64_t stopCounter(const int fd) { return -1; }
+#endif
+
+/* The lines of ftWeights read are an upper bound of its misses, they are shown even if the counters can't be read
+ */
+static void printMisses(const char* name, const double lines, const int64_t l1, const int64_t llc, const int64_t ops)
+{
+    printf("%-8s ftWeights lines read: %6.1f/op  ", name, lines);
+    if (l1 < 0 && llc < 0)
+    {
+        printf("cache misses unavailable (perf_event_open isn't allowed)\n");
+        return;
+    }
+    printf("L1d misses: %6.1f/op  LLC misses: %6.1f/op\n",
+        l1 < 0? -1.0 : (double)l1 / (double)ops, llc < 0? -1.0 : (double)llc / (double)ops);
+}
+
+/* Times each part of the evaluation on a fixed corpus, positions[i] with the move moves[i] played from it:
+ * the refresh of both perspectives (inputLayer), the update of both after the move (applyChanges, the
+ * perspectives whose king moved aren't updated, they are refreshed) and the layers (evaluateAcc).
+ * The refreshes and the updates only read the rows of ftWeights besides a few accumulators that stay in L1,
+ * so the misses counted while they run are the ones of ftWeights
+ */
+void profileNNUE(const NNUE* nn, const Board* positions, const Move* moves, const int n, const int iterations)
+{
+    int16_t (*accs)[kDimensionFT] = malloc(sizeof(int16_t)*kDimensionFT*(size_t)n);
+    Board* after = malloc(sizeof(Board)*(size_t)n);
+    NNUEChangeList* changes = malloc(sizeof(NNUEChangeList)*(size_t)n);
+    CHECK_MALLOC(accs);
+    CHECK_MALLOC(after);
+    CHECK_MALLOC(changes);
+
+    int numUpdates = 0;
+    int64_t refreshRows = 0, updateRows = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        History h;
+        after[i] = positions[i];
+        makeMove(&after[i], moves[i], &h);
+        changes[i] = (NNUEChangeList) {.idx = 0};
+        determineChanges(moves[i], &changes[i], positions[i].stm);
+        numUpdates += 2 - (changes[i].refresh != -1);
+        refreshRows += 2 * (POPCOUNT(positions[i].allPieces) - 2);
+        updateRows += (2 - (changes[i].refresh != -1)) * changes[i].idx;
+    }
+    const double linesPerRow = (double)sizeof(int16_t) * nn->arch.halfDims / 64.0;
+
+    //Distinct rows of the feature transformer the corpus reads, the working set of the refreshes
+    uint8_t* rowUsed = calloc(kInputDimensionsFT, 1);
+    CHECK_MALLOC(rowUsed);
+    int rows = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        for (int color = BLACK; color <= WHITE; ++color)
+        {
+            const int ksq = toSf(color, LSB_INDEX(positions[i].piece[color][KING]));
+            for (int c = BLACK; c <= WHITE; ++c)
+            {
+                for (int piece = QUEEN; piece <= PAWN; ++piece)
+                {
+                    const int sfPc = (c==WHITE? 6 : 14) - piece;
+                    for (uint64_t bb = positions[i].piece[c][piece]; bb; REMOVE_LSB(bb))
+                    {
+                        const int idx = makeIndex(color, toSf(color, LSB_INDEX(bb)), sfPc, ksq);
+                        rows += !rowUsed[idx];
+                        rowUsed[idx] = 1;
+                    }
+                }
+            }
+        }
+    }
+    free(rowUsed);
+
+    const int l1 = openCacheCounter(1), llc = openCacheCounter(0);
+    const int64_t refreshes = 2LL * n * iterations, updates = (int64_t)numUpdates * iterations, forwards = (int64_t)n * iterations;
+    int64_t checksum = 0;
+
+    startCounter(l1);
+    startCounter(llc);
+    clock_t start = clock();
+    for (int it = 0; it < iterations; ++it)
+    {
+        for (int i = 0; i < n; ++i)
         {
-            for (int j = 0; j < kHalfDimensionFT; ++j)
-                inp[j] -= nn->ftWeights[offset+j];
+            inputLayer(nn, &positions[i], WHITE, accs[i]);
+            inputLayer(nn, &positions[i], BLACK, accs[i] + kHalfDimensionFT);
         }
     }
+    const double refreshTime = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / (double)refreshes;
+    const int64_t refreshL1 = stopCounter(l1), refreshLLC = stopCounter(llc);
+
+    //The accumulators of the positions are updated to the ones after the move into a buffer
+    int16_t updated[kDimensionFT];
+    startCounter(l1);
+    startCounter(llc);
+    start = clock();
+    for (int it = 0; it < iterations; ++it)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            for (int color = BLACK; color <= WHITE; ++color)
+            {
+                if (changes[i].refresh == color)
+                    continue;
+                const int offset = color == WHITE? 0 : kHalfDimensionFT;
+                applyChangesFrom(nn, &after[i], &changes[i], color, accs[i] + offset, updated + offset);
+            }
+            checksum += updated[i & (kHalfDimensionFT - 1)];
+        }
+    }
+    const double updateTime = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / (double)updates;
+    const int64_t updateL1 = stopCounter(l1), updateLLC = stopCounter(llc);
+
+    start = clock();
+    for (int it = 0; it < iterations; ++it)
+        for (int i = 0; i < n; ++i)
+            checksum += evaluateAcc(nn, &positions[i], accs[i]);
+    const double forwardTime = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / (double)forwards;
+
+    #ifdef NNUE_SPARSE
+    const char* backend = "sparse";
+    #else
+    const char* backend = "regular";
+    #endif
+    printf("%s backend, %s kernels, HalfKP 2x%d\n", backend, kernelName(), nn->arch.halfDims);
+    printf("%d positions, %d updates, %d rows of ftWeights read (%d KB)\n",
+        n, numUpdates, rows, (int)((size_t)rows * sizeof(int16_t) * (size_t)nn->arch.halfDims / 1024));
+    printf("refresh  %8.1f ns\n", refreshTime);
+    printf("update   %8.1f ns\n", updateTime);
+    printf("forward  %8.1f ns\n", forwardTime);
+    printMisses("refresh", linesPerRow * (double)refreshRows / (2 * n), refreshL1, refreshLLC, refreshes);
+    printMisses("update", linesPerRow * (double)updateRows / numUpdates, updateL1, updateLLC, updates);
+    printf("checksum %ld\n", (long)checksum);
+
+    if (l1 >= 0)
+        close(l1);
+    if (llc >= 0)
+        close(llc);
+    free(accs);
+    free(after);
+    free(changes);
 }
 
+//The search uses mainEvaluator
 void initNNUEAcc(const Board* b)
 {
     #ifdef USE_NNUE
-    inputLayer(&nnue, b, WHITE, nInput);
-    inputLayer(&nnue, b, BLACK, nInput + kHalfDimensionFT);
+    evaluatorSetPosition(&mainEvaluator, b);
     #endif
 }
 
-void updateDo(NNUEChangeList* q, const Move m, const Board* b)
+void updateDo(const Move m, const Board* b)
 {
     #ifdef USE_NNUE
-    determineChanges(m, q, 1^b->stm);
-
-    applyChanges(&nnue, b, q, WHITE, nInput);
-    applyChanges(&nnue, b, q, BLACK, nInput+kHalfDimensionFT);
-    assert(q->idx < 5);
+    evaluatorDo(&mainEvaluator, m, b);
     #endif
 }
 
-void updateUndo(NNUEChangeList* q, const Board* b)
+void updateUndo(void)
 {
     #ifdef USE_NNUE
-    assert(q->idx < 5);
-
-    for (int i = 0; i < q->idx; ++i)
-        q->changes[i].appears ^= 1;
-
-    applyChanges(&nnue, b, q, WHITE, nInput);
-    applyChanges(&nnue, b, q, BLACK, nInput+kHalfDimensionFT);
-    q->idx = 0;
+    evaluatorUndo(&mainEvaluator);
     #endif
 }
 
 int evaluateNNUE(const Board* const b, const int useAcc)
 {
-    int ev;
-    if (useAcc)
-        ev = evaluateAcc(&nnue, b, nInput);
-    else
-        ev = evaluate(&nnue, b, nInput);
-    return ev;
+    return evaluatorEval(&mainEvaluator, b, useAcc);
 }
@@ -0,0 +1,23 @@
+/* nnueembed.c
+ * Includes the net NNUE_EMBED in the binary, the makefile rebuilds this file when the net changes
+ */
+
+#ifdef NNUE_EMBED
+
+/* The file is 63 bytes past a 64 byte boundary so the biases and the weights of the feature transformer
+ * (at 193 and 705 bytes from the start with the usual 177 bytes of description) are aligned and can be used
+ * in place, nets with other descriptions are copied when they are loaded
+ */
+__asm__(
+    "    .section .rodata\n"
+    "    .balign 64\n"
+    "    .skip 63\n"
+    "    .global embeddedNNUE\n"
+    "embeddedNNUE:\n"
+    "    .incbin \"" NNUE_EMBED "\"\n"
+    "    .global embeddedNNUEEnd\n"
+    "embeddedNNUEEnd:\n"
+    "    .previous\n"
+);
+
+#endif
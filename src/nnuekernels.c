@@ -0,0 +1,956 @@
+/* nnuekernels.c
+ * SIMD kernels of the feature transformer and the hidden layers, the best ones the cpu supports
+ * are chosen at startup so the same binary works without -march=native
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/global.h"
+#include "../include/board.h"
+#include "../include/moves.h"
+#include "../include/nnue.h"
+#include "../include/nnuearch.h"
+#include "../include/nnuekernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define USE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static void ftUpdateScalar(int16_t* out, const int16_t* in, const int16_t** add, const int numAdd, const int16_t** sub, const int numSub, const int dims)
+{
+    if (out != in)
+        memcpy(out, in, sizeof(int16_t)*(size_t)dims);
+
+    for (int i = 0; i < numAdd; ++i)
+        for (int j = 0; j < dims; ++j)
+            out[j] += add[i][j];
+    for (int i = 0; i < numSub; ++i)
+        for (int j = 0; j < dims; ++j)
+            out[j] -= sub[i][j];
+}
+
+static void clipInputScalar(clipped_t* out, const int16_t* acc, const int stm, const int halfDims)
+{
+    const int16_t* persp[2] = {acc + (1^stm)*kHalfDimensionFT, acc + stm*kHalfDimensionFT};
+
+    for (int p = 0; p < 2; ++p)
+        for (int j = 0; j < halfDims; ++j)
+            out[permuteInput(p*halfDims + j)] = clip(persp[p][j]);
+}
+
+static void affineScalar(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    for (int i = 0; i < kDimensionHidden; ++i)
+    {
+        int32_t sum = bs[i];
+        const weight_t* row = ws + i*inSize;
+        for (int j = 0; j < inSize; ++j)
+            sum += in[j]*row[j];
+        out[i] = clip64(sum);
+    }
+}
+
+static void affineSparseScalar(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    int32_t sum[kDimensionHidden];
+    for (int i = 0; i < kDimensionHidden; ++i)
+        sum[i] = bs[i];
+
+    for (int c = 0; c < inSize / 4; ++c)
+    {
+        const clipped_t* block = in + 4*c;
+        if (!(block[0] | block[1] | block[2] | block[3]))
+            continue;
+
+        const weight_t* w = ws + 4*kDimensionHidden*c;
+        for (int i = 0; i < kDimensionHidden; ++i)
+            for (int k = 0; k < 4; ++k)
+                sum[i] += block[k]*w[4*i+k];
+    }
+
+    for (int i = 0; i < kDimensionHidden; ++i)
+        out[i] = clip64(sum[i]);
+}
+
+static int32_t outputScalar(const clipped_t* in, const weight_t* ws, const int32_t bias)
+{
+    int32_t out = bias;
+    for (int i = 0; i < kDimensionHidden; ++i)
+        out += in[i]*ws[i];
+
+    return out;
+}
+
+#ifdef USE_X86_KERNELS
+
+/* The accumulator is processed in blocks of 8 registers, the rows are added to the block while
+ * it is in registers, so each lane is loaded and stored once
+ */
+__attribute__((target("sse2")))
+static void ftUpdateSSE2(int16_t* out, const int16_t* in, const int16_t** add, const int numAdd, const int16_t** sub, const int numSub, const int dims)
+{
+    for (int block = 0; block < dims; block += 64)
+    {
+        __m128i r[8];
+        for (int k = 0; k < 8; ++k)
+            r[k] = _mm_loadu_si128((const __m128i*)(in + block) + k);
+
+        for (int i = 0; i < numAdd; ++i)
+            for (int k = 0; k < 8; ++k)
+                r[k] = _mm_add_epi16(r[k], _mm_loadu_si128((const __m128i*)(add[i] + block) + k));
+        for (int i = 0; i < numSub; ++i)
+            for (int k = 0; k < 8; ++k)
+                r[k] = _mm_sub_epi16(r[k], _mm_loadu_si128((const __m128i*)(sub[i] + block) + k));
+
+        for (int k = 0; k < 8; ++k)
+            _mm_storeu_si128((__m128i*)(out + block) + k, r[k]);
+    }
+}
+
+/* The packs don't cross lanes with 128 bit registers, the inputs are packed in the order
+ * that the AVX2 packs leave (see permuteInput). The max before the pack clips the negatives
+ */
+__attribute__((target("sse2")))
+static void clipInputSSE2(clipped_t* out, const int16_t* acc, const int stm, const int halfDims)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const int16_t* persp[2] = {acc + (1^stm)*kHalfDimensionFT, acc + stm*kHalfDimensionFT};
+
+    for (int p = 0; p < 2; ++p)
+    {
+        for (int j = 0; j < halfDims; j += 32)
+        {
+            __m128i a[4];
+            for (int k = 0; k < 4; ++k)
+                a[k] = _mm_max_epi16(_mm_loadu_si128((const __m128i*)(persp[p] + j) + k), zero);
+            _mm_storeu_si128((__m128i*)(out + p*halfDims + j), _mm_packs_epi16(a[0], a[2]));
+            _mm_storeu_si128((__m128i*)(out + p*halfDims + j + 16), _mm_packs_epi16(a[1], a[3]));
+        }
+    }
+}
+
+/* Without maddubs the inputs (unsigned) and the weights (signed) are widened to int16_t,
+ * the unpack of w with itself and the shift extend the sign
+ */
+__attribute__((target("sse2")))
+static inline __m128i dotSSE2(const __m128i* in, const weight_t* row, const int chunks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+
+    for (int k = 0; k < chunks; ++k)
+    {
+        const __m128i w = _mm_loadu_si128((const __m128i*)row + k);
+        const __m128i wLo = _mm_srai_epi16(_mm_unpacklo_epi8(w, w), 8);
+        const __m128i wHi = _mm_srai_epi16(_mm_unpackhi_epi8(w, w), 8);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(in[k], zero), wLo));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpackhi_epi8(in[k], zero), wHi));
+    }
+
+    return sum;
+}
+
+//Sum of each register of 4 int32_t, there is no hadd in SSE2 so they are transposed
+__attribute__((target("sse2")))
+static inline __m128i reduce4SSE2(const __m128i s0, const __m128i s1, const __m128i s2, const __m128i s3)
+{
+    const __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(s0, s1), _mm_unpackhi_epi32(s0, s1));
+    const __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(s2, s3), _mm_unpackhi_epi32(s2, s3));
+    return _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+}
+
+//Clipped relu of the 32 outputs, 4 per register in order
+__attribute__((target("sse2")))
+static inline void clipOutputsSSE2(clipped_t* out, const __m128i* sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int k = 0; k < 8; k += 4)
+    {
+        const __m128i a = _mm_max_epi16(_mm_packs_epi32(_mm_srai_epi32(sums[k], SHIFT), _mm_srai_epi32(sums[k+1], SHIFT)), zero);
+        const __m128i b = _mm_max_epi16(_mm_packs_epi32(_mm_srai_epi32(sums[k+2], SHIFT), _mm_srai_epi32(sums[k+3], SHIFT)), zero);
+        _mm_storeu_si128((__m128i*)(out + 4*k), _mm_packs_epi16(a, b));
+    }
+}
+
+__attribute__((target("sse2")))
+static void affineSSE2(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    const int chunks = inSize / 16;
+    __m128i input[kDimensionFT / 16];
+    for (int k = 0; k < chunks; ++k)
+        input[k] = _mm_loadu_si128((const __m128i*)in + k);
+
+    __m128i sums[kDimensionHidden / 4];
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const __m128i s = reduce4SSE2(dotSSE2(input, ws + (i+0)*inSize, chunks), dotSSE2(input, ws + (i+1)*inSize, chunks),
+                                      dotSSE2(input, ws + (i+2)*inSize, chunks), dotSSE2(input, ws + (i+3)*inSize, chunks));
+        sums[i/4] = _mm_add_epi32(s, _mm_loadu_si128((const __m128i*)(bs + i)));
+    }
+
+    clipOutputsSSE2(out, sums);
+}
+
+/* Same as affineSparseAVX2, the block of 4 inputs is widened to int16_t, so each madd leaves
+ * the sums of 2 pairs of 2 outputs and they are added at the end
+ */
+__attribute__((target("sse2")))
+static void affineSparseSSE2(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    uint16_t active[kDimensionFT / 4];
+    int numActive = 0;
+    for (int j = 0; j < inSize; j += 16)
+    {
+        const __m128i isZero = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(in + j)), zero);
+        unsigned mask = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(isZero)) & 0xF;
+        for (; mask; mask &= mask - 1)
+            active[numActive++] = (uint16_t)(j / 4 + __builtin_ctz(mask));
+    }
+
+    __m128i pairs[16];
+    for (int k = 0; k < 16; ++k)
+        pairs[k] = zero;
+
+    for (int a = 0; a < numActive; ++a)
+    {
+        int32_t block;
+        memcpy(&block, in + 4*active[a], sizeof(block));
+        const __m128i x = _mm_unpacklo_epi8(_mm_set1_epi32(block), zero);
+        const __m128i* w = (const __m128i*)(ws + 4*kDimensionHidden*active[a]);
+
+        for (int k = 0; k < 8; ++k)
+        {
+            const __m128i wk = _mm_loadu_si128(w + k);
+            pairs[2*k]   = _mm_add_epi32(pairs[2*k],   _mm_madd_epi16(x, _mm_srai_epi16(_mm_unpacklo_epi8(wk, wk), 8)));
+            pairs[2*k+1] = _mm_add_epi32(pairs[2*k+1], _mm_madd_epi16(x, _mm_srai_epi16(_mm_unpackhi_epi8(wk, wk), 8)));
+        }
+    }
+
+    __m128i sums[8];
+    for (int k = 0; k < 8; ++k)
+    {
+        const __m128 lo = _mm_castsi128_ps(pairs[2*k]), hi = _mm_castsi128_ps(pairs[2*k+1]);
+        const __m128i s = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+                                        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+        sums[k] = _mm_add_epi32(s, _mm_loadu_si128((const __m128i*)bs + k));
+    }
+
+    clipOutputsSSE2(out, sums);
+}
+
+__attribute__((target("sse2")))
+static int32_t outputSSE2(const clipped_t* in, const weight_t* ws, const int32_t bias)
+{
+    const __m128i input[2] = {_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)in + 1)};
+    __m128i r = dotSSE2(input, ws, 2);
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0x4E));
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0xB1));
+
+    return _mm_cvtsi128_si32(r) + bias;
+}
+
+//As clipInputSSE2, but the max is done once after the pack
+__attribute__((target("sse4.1")))
+static void clipInputSSE41(clipped_t* out, const int16_t* acc, const int stm, const int halfDims)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const int16_t* persp[2] = {acc + (1^stm)*kHalfDimensionFT, acc + stm*kHalfDimensionFT};
+
+    for (int p = 0; p < 2; ++p)
+    {
+        for (int j = 0; j < halfDims; j += 32)
+        {
+            __m128i a[4];
+            for (int k = 0; k < 4; ++k)
+                a[k] = _mm_loadu_si128((const __m128i*)(persp[p] + j) + k);
+            _mm_storeu_si128((__m128i*)(out + p*halfDims + j), _mm_max_epi8(_mm_packs_epi16(a[0], a[2]), zero));
+            _mm_storeu_si128((__m128i*)(out + p*halfDims + j + 16), _mm_max_epi8(_mm_packs_epi16(a[1], a[3]), zero));
+        }
+    }
+}
+
+//See dotAVX2
+__attribute__((target("sse4.1")))
+static inline __m128i dotSSE41(const __m128i* in, const weight_t* row, const int chunks)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sum = _mm_setzero_si128();
+
+    for (int k = 0; k < chunks; ++k)
+    {
+        const __m128i prod = _mm_maddubs_epi16(in[k], _mm_loadu_si128((const __m128i*)row + k));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(prod, ones));
+    }
+
+    return sum;
+}
+
+__attribute__((target("sse4.1")))
+static inline void clipOutputsSSE41(clipped_t* out, const __m128i* sums)
+{
+    for (int k = 0; k < 8; k += 4)
+    {
+        const __m128i a = _mm_packs_epi32(_mm_srai_epi32(sums[k], SHIFT), _mm_srai_epi32(sums[k+1], SHIFT));
+        const __m128i b = _mm_packs_epi32(_mm_srai_epi32(sums[k+2], SHIFT), _mm_srai_epi32(sums[k+3], SHIFT));
+        _mm_storeu_si128((__m128i*)(out + 4*k), _mm_max_epi8(_mm_packs_epi16(a, b), _mm_setzero_si128()));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void affineSSE41(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    const int chunks = inSize / 16;
+    __m128i input[kDimensionFT / 16];
+    for (int k = 0; k < chunks; ++k)
+        input[k] = _mm_loadu_si128((const __m128i*)in + k);
+
+    __m128i sums[kDimensionHidden / 4];
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const __m128i s0 = dotSSE41(input, ws + (i+0)*inSize, chunks);
+        const __m128i s1 = dotSSE41(input, ws + (i+1)*inSize, chunks);
+        const __m128i s2 = dotSSE41(input, ws + (i+2)*inSize, chunks);
+        const __m128i s3 = dotSSE41(input, ws + (i+3)*inSize, chunks);
+        const __m128i s = _mm_hadd_epi32(_mm_hadd_epi32(s0, s1), _mm_hadd_epi32(s2, s3));
+        sums[i/4] = _mm_add_epi32(s, _mm_loadu_si128((const __m128i*)(bs + i)));
+    }
+
+    clipOutputsSSE41(out, sums);
+}
+
+//See affineSparseAVX2
+__attribute__((target("sse4.1")))
+static void affineSparseSSE41(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    uint16_t active[kDimensionFT / 4];
+    int numActive = 0;
+    for (int j = 0; j < inSize; j += 16)
+    {
+        const __m128i isZero = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(in + j)), zero);
+        unsigned mask = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(isZero)) & 0xF;
+        for (; mask; mask &= mask - 1)
+            active[numActive++] = (uint16_t)(j / 4 + __builtin_ctz(mask));
+    }
+
+    __m128i sum[8];
+    for (int k = 0; k < 8; ++k)
+        sum[k] = _mm_loadu_si128((const __m128i*)bs + k);
+
+    for (int a = 0; a < numActive; ++a)
+    {
+        int32_t block;
+        memcpy(&block, in + 4*active[a], sizeof(block));
+        const __m128i x = _mm_set1_epi32(block);
+        const __m128i* w = (const __m128i*)(ws + 4*kDimensionHidden*active[a]);
+
+        for (int k = 0; k < 8; ++k)
+            sum[k] = _mm_add_epi32(sum[k], _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_loadu_si128(w + k)), ones));
+    }
+
+    clipOutputsSSE41(out, sum);
+}
+
+__attribute__((target("sse4.1")))
+static int32_t outputSSE41(const clipped_t* in, const weight_t* ws, const int32_t bias)
+{
+    const __m128i input[2] = {_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)in + 1)};
+    __m128i r = dotSSE41(input, ws, 2);
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0x4E));
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0xB1));
+
+    return _mm_cvtsi128_si32(r) + bias;
+}
+
+__attribute__((target("avx2")))
+static void ftUpdateAVX2(int16_t* out, const int16_t* in, const int16_t** add, const int numAdd, const int16_t** sub, const int numSub, const int dims)
+{
+    for (int block = 0; block < dims; block += 128)
+    {
+        __m256i r[8];
+        for (int k = 0; k < 8; ++k)
+            r[k] = _mm256_loadu_si256((const __m256i*)(in + block) + k);
+
+        for (int i = 0; i < numAdd; ++i)
+            for (int k = 0; k < 8; ++k)
+                r[k] = _mm256_add_epi16(r[k], _mm256_loadu_si256((const __m256i*)(add[i] + block) + k));
+        for (int i = 0; i < numSub; ++i)
+            for (int k = 0; k < 8; ++k)
+                r[k] = _mm256_sub_epi16(r[k], _mm256_loadu_si256((const __m256i*)(sub[i] + block) + k));
+
+        for (int k = 0; k < 8; ++k)
+            _mm256_storeu_si256((__m256i*)(out + block) + k, r[k]);
+    }
+}
+
+/* A perspective of 256 fits in 8 registers, smaller nets are processed in blocks
+ * of 128 with 4 registers
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void ftUpdateAVX512(int16_t* out, const int16_t* in, const int16_t** add, const int numAdd, const int16_t** sub, const int numSub, const int dims)
+{
+    if (dims == 256)
+    {
+        __m512i r[8];
+        for (int k = 0; k < 8; ++k)
+            r[k] = _mm512_loadu_si512((const __m512i*)in + k);
+
+        for (int i = 0; i < numAdd; ++i)
+            for (int k = 0; k < 8; ++k)
+                r[k] = _mm512_add_epi16(r[k], _mm512_loadu_si512((const __m512i*)add[i] + k));
+        for (int i = 0; i < numSub; ++i)
+            for (int k = 0; k < 8; ++k)
+                r[k] = _mm512_sub_epi16(r[k], _mm512_loadu_si512((const __m512i*)sub[i] + k));
+
+        for (int k = 0; k < 8; ++k)
+            _mm512_storeu_si512((__m512i*)out + k, r[k]);
+        return;
+    }
+
+    for (int block = 0; block < dims; block += 128)
+    {
+        __m512i r[4];
+        for (int k = 0; k < 4; ++k)
+            r[k] = _mm512_loadu_si512((const __m512i*)(in + block) + k);
+
+        for (int i = 0; i < numAdd; ++i)
+            for (int k = 0; k < 4; ++k)
+                r[k] = _mm512_add_epi16(r[k], _mm512_loadu_si512((const __m512i*)(add[i] + block) + k));
+        for (int i = 0; i < numSub; ++i)
+            for (int k = 0; k < 4; ++k)
+                r[k] = _mm512_sub_epi16(r[k], _mm512_loadu_si512((const __m512i*)(sub[i] + block) + k));
+
+        for (int k = 0; k < 4; ++k)
+            _mm512_storeu_si512((__m512i*)(out + block) + k, r[k]);
+    }
+}
+
+//packs saturates to [-128, 127] and the max clips the negatives, the lanes end up as in permuteInput
+__attribute__((target("avx2")))
+static void clipInputAVX2(clipped_t* out, const int16_t* acc, const int stm, const int halfDims)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const int16_t* persp[2] = {acc + (1^stm)*kHalfDimensionFT, acc + stm*kHalfDimensionFT};
+
+    for (int p = 0; p < 2; ++p)
+    {
+        for (int j = 0; j < halfDims; j += 32)
+        {
+            const __m256i a = _mm256_loadu_si256((const __m256i*)(persp[p] + j));
+            const __m256i b = _mm256_loadu_si256((const __m256i*)(persp[p] + j + 16));
+            _mm256_storeu_si256((__m256i*)(out + p*halfDims + j), _mm256_max_epi8(_mm256_packs_epi16(a, b), zero));
+        }
+    }
+}
+
+/* The inputs are unsigned (0 to 127) so maddubs can't overflow, 2*127*128 fits in int16_t,
+ * madd with ones widens the pairs to int32_t
+ */
+__attribute__((target("avx2")))
+static inline __m256i dotAVX2(const __m256i* in, const weight_t* row, const int chunks)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (int k = 0; k < chunks; ++k)
+    {
+        const __m256i prod = _mm256_maddubs_epi16(in[k], _mm256_loadu_si256((const __m256i*)row + k));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(prod, ones));
+    }
+
+    return sum;
+}
+
+/* Clipped relu of the 32 outputs (in order, 8 per register), it is a shift, two saturating packs
+ * and a max, the permute undoes the lane interleaving of the packs
+ */
+__attribute__((target("avx2")))
+static inline void clipOutputsAVX2(clipped_t* out, const __m256i* sums)
+{
+    __m256i v[4];
+    for (int k = 0; k < 4; ++k)
+        v[k] = _mm256_srai_epi32(sums[k], SHIFT);
+
+    const __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(v[0], v[1]), _mm256_packs_epi32(v[2], v[3]));
+    const __m256i ordered = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i*)out, _mm256_max_epi8(ordered, _mm256_setzero_si256()));
+}
+
+//Outputs are reduced 4 at a time with hadd
+__attribute__((target("avx2")))
+static void affineAVX2(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    const int chunks = inSize / 32;
+    __m256i input[kDimensionFT / 32];
+    for (int k = 0; k < chunks; ++k)
+        input[k] = _mm256_loadu_si256((const __m256i*)in + k);
+
+    __m128i sums[kDimensionHidden / 4];
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const __m256i s0 = dotAVX2(input, ws + (i+0)*inSize, chunks);
+        const __m256i s1 = dotAVX2(input, ws + (i+1)*inSize, chunks);
+        const __m256i s2 = dotAVX2(input, ws + (i+2)*inSize, chunks);
+        const __m256i s3 = dotAVX2(input, ws + (i+3)*inSize, chunks);
+        const __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(s0, s1), _mm256_hadd_epi32(s2, s3));
+        const __m128i r = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+        sums[i/4] = _mm_add_epi32(r, _mm_loadu_si128((const __m128i*)(bs + i)));
+    }
+
+    __m256i v[4];
+    for (int k = 0; k < 4; ++k)
+        v[k] = _mm256_set_m128i(sums[2*k+1], sums[2*k]);
+    clipOutputsAVX2(out, v);
+}
+
+/* Only the blocks of 4 inputs that aren't zero are multiplied, they are found 8 at a time with
+ * a compare and a movemask. Each block is broadcast and multiplied by the 4 weights of every output
+ */
+__attribute__((target("avx2")))
+static void affineSparseAVX2(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    uint16_t active[kDimensionFT / 4];
+    int numActive = 0;
+    for (int j = 0; j < inSize; j += 32)
+    {
+        const __m256i isZero = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(in + j)), zero);
+        unsigned mask = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(isZero)) & 0xFF;
+        for (; mask; mask &= mask - 1)
+            active[numActive++] = (uint16_t)(j / 4 + __builtin_ctz(mask));
+    }
+
+    __m256i sum[4];
+    for (int k = 0; k < 4; ++k)
+        sum[k] = _mm256_loadu_si256((const __m256i*)bs + k);
+
+    for (int a = 0; a < numActive; ++a)
+    {
+        int32_t block;
+        memcpy(&block, in + 4*active[a], sizeof(block));
+        const __m256i x = _mm256_set1_epi32(block);
+        const __m256i* w = (const __m256i*)(ws + 4*kDimensionHidden*active[a]);
+
+        for (int k = 0; k < 4; ++k)
+            sum[k] = _mm256_add_epi32(sum[k], _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256(w + k)), ones));
+    }
+
+    clipOutputsAVX2(out, sum);
+}
+
+__attribute__((target("avx2")))
+static int32_t outputAVX2(const clipped_t* in, const weight_t* ws, const int32_t bias)
+{
+    const __m256i input = _mm256_loadu_si256((const __m256i*)in);
+    const __m256i s = dotAVX2(&input, ws, 1);
+
+    __m128i r = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0x4E));
+    r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0xB1));
+
+    return _mm_cvtsi128_si32(r) + bias;
+}
+
+/* The packs interleave the 4 lanes, the permute of the 64 bit blocks leaves them in the order
+ * of the AVX2 packs (see permuteInput). Nets whose perspective isn't a multiple of 64 use the AVX2 one
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void clipInputAVX512(clipped_t* out, const int16_t* acc, const int stm, const int halfDims)
+{
+    if (halfDims & 63)
+    {
+        clipInputAVX2(out, acc, stm, halfDims);
+        return;
+    }
+
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i order = _mm512_setr_epi64(0, 4, 2, 6, 1, 5, 3, 7);
+    const int16_t* persp[2] = {acc + (1^stm)*kHalfDimensionFT, acc + stm*kHalfDimensionFT};
+
+    for (int p = 0; p < 2; ++p)
+    {
+        for (int j = 0; j < halfDims; j += 64)
+        {
+            const __m512i a = _mm512_loadu_si512((const __m512i*)(persp[p] + j));
+            const __m512i b = _mm512_loadu_si512((const __m512i*)(persp[p] + j + 32));
+            const __m512i packed = _mm512_permutexvar_epi64(order, _mm512_packs_epi16(a, b));
+            _mm512_storeu_si512((__m512i*)(out + p*halfDims + j), _mm512_max_epi8(packed, zero));
+        }
+    }
+}
+
+//See dotAVX2, the sum is folded into an AVX2 register
+__attribute__((target("avx512f,avx512bw")))
+static inline __m256i dotAVX512(const __m512i* in, const weight_t* row, const int chunks)
+{
+    const __m512i ones = _mm512_set1_epi16(1);
+    __m512i sum = _mm512_setzero_si512();
+
+    for (int k = 0; k < chunks; ++k)
+    {
+        const __m512i prod = _mm512_maddubs_epi16(in[k], _mm512_loadu_si512((const __m512i*)row + k));
+        sum = _mm512_add_epi32(sum, _mm512_madd_epi16(prod, ones));
+    }
+
+    return _mm256_add_epi32(_mm512_castsi512_si256(sum), _mm512_extracti64x4_epi64(sum, 1));
+}
+
+//The layers whose input isn't a multiple of 64 (the second one) use the AVX2 one
+__attribute__((target("avx512f,avx512bw")))
+static void affineAVX512(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    if (inSize & 63)
+    {
+        affineAVX2(out, in, inSize, ws, bs);
+        return;
+    }
+
+    const int chunks = inSize / 64;
+    __m512i input[kDimensionFT / 64];
+    for (int k = 0; k < chunks; ++k)
+        input[k] = _mm512_loadu_si512((const __m512i*)in + k);
+
+    __m128i sums[kDimensionHidden / 4];
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const __m256i s0 = dotAVX512(input, ws + (i+0)*inSize, chunks);
+        const __m256i s1 = dotAVX512(input, ws + (i+1)*inSize, chunks);
+        const __m256i s2 = dotAVX512(input, ws + (i+2)*inSize, chunks);
+        const __m256i s3 = dotAVX512(input, ws + (i+3)*inSize, chunks);
+        const __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(s0, s1), _mm256_hadd_epi32(s2, s3));
+        const __m128i r = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+        sums[i/4] = _mm_add_epi32(r, _mm_loadu_si128((const __m128i*)(bs + i)));
+    }
+
+    __m256i v[4];
+    for (int k = 0; k < 4; ++k)
+        v[k] = _mm256_set_m128i(sums[2*k+1], sums[2*k]);
+    clipOutputsAVX2(out, v);
+}
+
+//See affineSparseAVX2, the 32 outputs are in 2 registers and the blocks are found 16 at a time
+__attribute__((target("avx512f,avx512bw")))
+static void affineSparseAVX512(clipped_t* out, const clipped_t* in, const int inSize, const weight_t* ws, const int32_t* bs)
+{
+    if (inSize & 63)
+    {
+        affineSparseAVX2(out, in, inSize, ws, bs);
+        return;
+    }
+
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ones = _mm512_set1_epi16(1);
+
+    uint16_t active[kDimensionFT / 4];
+    int numActive = 0;
+    for (int j = 0; j < inSize; j += 64)
+    {
+        unsigned mask = _mm512_cmpneq_epi32_mask(_mm512_loadu_si512((const __m512i*)(in + j)), zero);
+        for (; mask; mask &= mask - 1)
+            active[numActive++] = (uint16_t)(j / 4 + __builtin_ctz(mask));
+    }
+
+    __m512i sum[2];
+    for (int k = 0; k < 2; ++k)
+        sum[k] = _mm512_loadu_si512((const __m512i*)bs + k);
+
+    for (int a = 0; a < numActive; ++a)
+    {
+        int32_t block;
+        memcpy(&block, in + 4*active[a], sizeof(block));
+        const __m512i x = _mm512_set1_epi32(block);
+        const __m512i* w = (const __m512i*)(ws + 4*kDimensionHidden*active[a]);
+
+        for (int k = 0; k < 2; ++k)
+            sum[k] = _mm512_add_epi32(sum[k], _mm512_madd_epi16(_mm512_maddubs_epi16(x, _mm512_loadu_si512(w + k)), ones));
+    }
+
+    const __m256i v[4] = {_mm512_castsi512_si256(sum[0]), _mm512_extracti64x4_epi64(sum[0], 1),
+                          _mm512_castsi512_si256(sum[1]), _mm512_extracti64x4_epi64(sum[1], 1)};
+    clipOutputsAVX2(out, v);
+}
+#endif
+
+/* Kernels of an instruction set, NULL if there isn't one for it,
+ * in that case the one of the previous instruction set is used.
+ * SSE4.1 (and SSSE3) add nothing to the adds and subs of ftUpdate, and the output layer
+ * of 32 inputs is a single AVX2 register, so those sets don't have them
+ */
+typedef struct
+{
+    const char* name;
+    FTUpdateKernel ftUpdate;
+    ClipInputKernel clipInput;
+    AffineKernel affine;
+    SparseAffineKernel affineSparse;
+    OutputKernel output;
+    int supported;
+} Kernel;
+
+//From the slowest to the fastest
+static Kernel kernels[] =
+{
+    {"scalar", ftUpdateScalar, clipInputScalar, affineScalar, affineSparseScalar, outputScalar, 1},
+    #ifdef USE_X86_KERNELS
+    {"sse2", ftUpdateSSE2, clipInputSSE2, affineSSE2, affineSparseSSE2, outputSSE2, 0},
+    {"sse4.1", NULL, clipInputSSE41, affineSSE41, affineSparseSSE41, outputSSE41, 0},
+    {"avx2", ftUpdateAVX2, clipInputAVX2, affineAVX2, affineSparseAVX2, outputAVX2, 0},
+    {"avx512", ftUpdateAVX512, clipInputAVX512, affineAVX512, affineSparseAVX512, NULL, 0},
+    #endif
+};
+static const int numKernels = sizeof(kernels) / sizeof(kernels[0]);
+
+FTUpdateKernel ftUpdate = ftUpdateScalar;
+ClipInputKernel clipInput = clipInputScalar;
+AffineKernel affine = affineScalar;
+SparseAffineKernel affineSparse = affineSparseScalar;
+OutputKernel affineOutput = outputScalar;
+static int selected = 0;
+//Best instruction set the cpu supports and the one whose ftUpdate is the fastest, they may not be the same
+static int bestSet = 0;
+static int ftUpdateSet = 0;
+static char mixedName[32];
+
+static void useKernels(const int last)
+{
+    for (int i = 0; i <= last; ++i)
+    {
+        if (!kernels[i].supported)
+            continue;
+        if (kernels[i].ftUpdate)     ftUpdate = kernels[i].ftUpdate;
+        if (kernels[i].clipInput)    clipInput = kernels[i].clipInput;
+        if (kernels[i].affine)       affine = kernels[i].affine;
+        if (kernels[i].affineSparse) affineSparse = kernels[i].affineSparse;
+        if (kernels[i].output)       affineOutput = kernels[i].output;
+    }
+    selected = last;
+    mixedName[0] = '\0';
+}
+
+/* Time of the accumulator updates of a search with the ftUpdate of set k, mostly updates of a
+ * capture (2 rows added, 2 subtracted) and a refresh of 30 rows every 8 of them
+ */
+static clock_t timeFTUpdate(const int k, const int16_t* rows, int16_t* acc)
+{
+    enum {ITERATIONS = 8192};
+    const int16_t* add[30];
+    const int16_t* sub[2];
+    const FTUpdateKernel kernel = kernels[k].ftUpdate;
+
+    const clock_t start = clock();
+    for (int it = 0; it < ITERATIONS; ++it)
+    {
+        if ((it & 7) == 0)
+        {
+            for (int i = 0; i < 30; ++i)
+                add[i] = rows + kHalfDimensionFT * ((it + 7*i) & 63);
+            kernel(acc, rows, add, 30, NULL, 0, kHalfDimensionFT);
+        }
+        add[0] = rows + kHalfDimensionFT * (it & 63);
+        add[1] = rows + kHalfDimensionFT * ((it + 17) & 63);
+        sub[0] = rows + kHalfDimensionFT * ((it + 31) & 63);
+        sub[1] = rows + kHalfDimensionFT * ((it + 47) & 63);
+        kernel(acc, acc, add, 2, sub, 2, kHalfDimensionFT);
+    }
+    return clock() - start;
+}
+
+/* The wider kernels aren't always faster for the feature transformer (avx512 can be slower than avx2
+ * because of the clock), so each set that has one is timed. The first round is the warm up,
+ * then the best time of each one is kept
+ */
+static int fastestFTUpdate(const int last)
+{
+    int16_t* rows = calloc(kHalfDimensionFT * 64, sizeof(int16_t));
+    int16_t* acc = calloc(kHalfDimensionFT, sizeof(int16_t));
+    CHECK_MALLOC(rows);
+    CHECK_MALLOC(acc);
+
+    clock_t times[numKernels];
+    for (int rep = 0; rep < 4; ++rep)
+    {
+        for (int k = 0; k <= last; ++k)
+        {
+            if (!kernels[k].supported || !kernels[k].ftUpdate)
+                continue;
+            const clock_t t = timeFTUpdate(k, rows, acc);
+            if (rep == 1 || (rep > 1 && t < times[k]))
+                times[k] = t;
+        }
+    }
+
+    int fastest = 0;
+    for (int k = 1; k <= last; ++k)
+        if (kernels[k].supported && kernels[k].ftUpdate && times[k] < times[fastest])
+            fastest = k;
+
+    free(rows);
+    free(acc);
+    return fastest;
+}
+
+/* The kernels of the best set, except ftUpdate that is the fastest one
+ */
+void defaultKernels(void)
+{
+    useKernels(bestSet);
+    if (ftUpdateSet != bestSet)
+    {
+        ftUpdate = kernels[ftUpdateSet].ftUpdate;
+        sprintf(mixedName, "%s (%s ftUpdate)", kernels[bestSet].name, kernels[ftUpdateSet].name);
+    }
+}
+
+void initKernels(void)
+{
+    #ifdef USE_X86_KERNELS
+    __builtin_cpu_init();
+    kernels[1].supported = __builtin_cpu_supports("sse2");
+    kernels[2].supported = __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+    kernels[3].supported = __builtin_cpu_supports("avx2");
+    kernels[4].supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    #endif
+
+    bestSet = 0;
+    for (int i = 0; i < numKernels; ++i)
+        if (kernels[i].supported)
+            bestSet = i;
+    ftUpdateSet = fastestFTUpdate(bestSet);
+    defaultKernels();
+}
+
+int kernelSets(void)
+{
+    return numKernels;
+}
+
+int selectedKernels(void)
+{
+    return selected;
+}
+
+/* Uses the kernels of the k-th instruction set (and the ones before it),
+ * returns 0 if the cpu doesn't support it
+ */
+int selectKernels(const int k)
+{
+    if (k < 0 || k >= numKernels || !kernels[k].supported)
+        return 0;
+
+    useKernels(k);
+    return 1;
+}
+
+const char* kernelName(void)
+{
+    return mixedName[0]? mixedName : kernels[selected].name;
+}
+
+/* Times each kernel that the cpu supports, a refresh adds 30 rows to the biases,
+ * an update adds 2 rows and subtracts 2 (from a capture to a castle),
+ * forward goes from the accumulator to the output of the network
+ */
+void benchKernels(void)
+{
+    enum {NUM_ROWS = 4096, NUM_IDX = 1 << 16, ITERATIONS = 200000};
+
+    int16_t* rows = malloc(sizeof(int16_t)*kHalfDimensionFT*NUM_ROWS);
+    int* idx = malloc(sizeof(int)*NUM_IDX);
+    CHECK_MALLOC(rows);
+    CHECK_MALLOC(idx);
+    srand(1);
+    for (int i = 0; i < kHalfDimensionFT*NUM_ROWS; ++i)
+        rows[i] = (int16_t)((rand() & 127) - 64);
+    //The rows are chosen beforehand so the timing is only the kernel
+    for (int i = 0; i < NUM_IDX; ++i)
+        idx[i] = kHalfDimensionFT * (rand() % NUM_ROWS);
+
+    //Random layers, the accumulators go past both ends of the clipping
+    weight_t ws1[kDimensionHidden*kDimensionFT], ws2[kDimensionHidden*kDimensionHidden], ws3[kDimensionHidden];
+    int32_t bs1[kDimensionHidden], bs2[kDimensionHidden];
+    int16_t accs[16][kDimensionFT];
+    for (int i = 0; i < kDimensionHidden*kDimensionFT; ++i)
+        ws1[i] = (weight_t)((rand() & 63) - 32);
+    for (int i = 0; i < kDimensionHidden*kDimensionHidden; ++i)
+        ws2[i] = (weight_t)((rand() & 255) - 128);
+    for (int i = 0; i < kDimensionHidden; ++i)
+    {
+        ws3[i] = (weight_t)((rand() & 255) - 128);
+        bs1[i] = (rand() & 8191) - 2048;
+        bs2[i] = (rand() & 8191) - 2048;
+    }
+    for (int i = 0; i < 16; ++i)
+        for (int j = 0; j < kDimensionFT; ++j)
+            accs[i][j] = (int16_t)((rand() & 255) - 96);
+
+    int16_t acc[kHalfDimensionFT], result[kHalfDimensionFT];
+    const int16_t* add[30];
+    const int16_t* sub[2];
+    clipped_t input[kDimensionFT], hidden1[kDimensionHidden], hidden2[kDimensionHidden];
+    int64_t forwardResult = 0;
+
+    printf("Selected kernel: %s\n", kernelName());
+    for (int k = 0; k < numKernels; ++k)
+    {
+        if (!kernels[k].supported)
+            continue;
+        useKernels(k);
+
+        int p = 0;
+        clock_t start = clock();
+        for (int it = 0; it < ITERATIONS; ++it)
+        {
+            for (int i = 0; i < 30; ++i, p = (p + 1) & (NUM_IDX - 1))
+                add[i] = rows + idx[p];
+            ftUpdate(acc, rows, add, 30, NULL, 0, kHalfDimensionFT);
+        }
+        const double refresh = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / ITERATIONS;
+
+        start = clock();
+        for (int it = 0; it < ITERATIONS; ++it, p = (p + 4) & (NUM_IDX - 1))
+        {
+            add[0] = rows + idx[p];
+            add[1] = rows + idx[p+1];
+            sub[0] = rows + idx[p+2];
+            sub[1] = rows + idx[p+3];
+            ftUpdate(acc, acc, add, 2, sub, 2, kHalfDimensionFT);
+        }
+        const double update = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / ITERATIONS;
+
+        int64_t forwardSum = 0;
+        start = clock();
+        for (int it = 0; it < ITERATIONS; ++it)
+        {
+            clipInput(input, accs[it & 15], it & 1, kHalfDimensionFT);
+            affine(hidden1, input, kDimensionFT, ws1, bs1);
+            affine(hidden2, hidden1, kDimensionHidden, ws2, bs2);
+            forwardSum += affineOutput(hidden2, ws3, 0);
+        }
+        const double forward = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / ITERATIONS;
+
+        //All the kernels have to give the same result
+        if (k == 0)
+        {
+            memcpy(result, acc, sizeof(acc));
+            forwardResult = forwardSum;
+        }
+        const int matches = memcmp(result, acc, sizeof(acc)) == 0 && forwardSum == forwardResult;
+
+        printf("%-8s refresh: %7.1fns  update: %6.1fns  forward: %6.1fns  %s\n",
+            kernels[k].name, refresh, update, forward, matches? "" : "[MISMATCH]");
+    }
+    defaultKernels();
+
+    free(rows);
+    free(idx);
+}
@@ -0,0 +1,190 @@
+/* packedpos.c
+ * Binary format of the position files, each one is parsed once when it is written
+ * and afterwards it is just mapped into memory
+ * File: POSITIONS_MAGIC (8 bytes), number of positions (uint64_t) and the PackedPos
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/global.h"
+#include "../include/board.h"
+#include "../include/evaluation.h"
+#include "../include/packedpos.h"
+
+#define POSITIONS_MAGIC "NOCPOS1\n"
+#define HEADER_SIZE 16
+
+PackedPos packPosition(const Board* b, const int result, const int score)
+{
+    PackedPos p = (PackedPos) {.occupied = b->allPieces, .result = (uint8_t)result, .score = (int16_t)score};
+    p.flags = (uint8_t)(b->stm | (b->castleInfo << 1));
+    p.enPass = (uint8_t)b->enPass;
+    p.fifty = (uint8_t)min(b->fifty, 255);
+
+    int n = 0;
+    for (uint64_t bb = b->allPieces; bb; REMOVE_LSB(bb), ++n)
+    {
+        const uint64_t pos = bb & -bb;
+        const int c = (b->color[WHITE] & pos) != 0;
+        int piece = KING;
+        while (!(b->piece[c][piece] & pos))
+            ++piece;
+
+        p.pieces[n >> 1] |= (uint8_t)(((c << 3) | piece) << ((n & 1) << 2));
+    }
+
+    return p;
+}
+
+/* Returns 1 if p can be unpacked and used: at most 32 pieces, all with a valid code, one king of each color,
+ * no pawns in the first or last rank and a known result (not RESULT_NONE).
+ * The records of the files are checked with it when they are read, not when the file is opened
+ */
+int validPosition(const PackedPos* p)
+{
+    const int numPieces = POPCOUNT(p->occupied);
+    if (numPieces > 32 || p->result > RESULT_WHITE || p->flags > 31)
+        return 0;
+
+    int n = 0, kings[2] = {0, 0};
+    for (uint64_t bb = p->occupied; bb; REMOVE_LSB(bb), ++n)
+    {
+        const int code = (p->pieces[n >> 1] >> ((n & 1) << 2)) & 0xf;
+        if ((code & 7) > PAWN || ((code & 7) == PAWN && (bb & -bb & 0xff000000000000ff)))
+            return 0;
+        kings[code >> 3] += (code & 7) == KING;
+    }
+
+    return kings[BLACK] == 1 && kings[WHITE] == 1;
+}
+
+Board unpackPosition(const PackedPos* p)
+{
+    Board b = (Board) {.stm = p->flags & 1, .castleInfo = p->flags >> 1, .enPass = p->enPass, .fifty = p->fifty};
+
+    int n = 0;
+    for (uint64_t bb = p->occupied; bb; REMOVE_LSB(bb), ++n)
+    {
+        const int code = (p->pieces[n >> 1] >> ((n & 1) << 2)) & 0xf;
+        const uint64_t pos = bb & -bb;
+        b.piece[code >> 3][code & 7] |= pos;
+        b.color[code >> 3] |= pos;
+    }
+
+    b.color[AV_WHITE] = ~b.color[WHITE];
+    b.color[AV_BLACK] = ~b.color[BLACK];
+    b.allPieces = p->occupied;
+    computePSQT(&b);
+
+    assert(boardIsOK(&b));
+
+    return b;
+}
+
+//Result of the csv files: w, d or b
+int parseResult(const char c)
+{
+    switch (c)
+    {
+        case 'w':
+            return RESULT_WHITE;
+        case 'd':
+            return RESULT_DRAW;
+        case 'b':
+            return RESULT_BLACK;
+    }
+
+    return RESULT_NONE;
+}
+
+/* Maps the file into memory, returns 0 if it isn't a position file.
+ * Nothing is read yet, so the records have to be checked with validPosition when they are used
+ */
+int openPositions(const char* path, PositionFile* file)
+{
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Can't open position file: %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    const size_t size = (size_t)st.st_size;
+    if (size < HEADER_SIZE)
+    {
+        fprintf(stderr, "%s isn't a position file, it only has %ld bytes\n", path, (long)size);
+        close(fd);
+        return 0;
+    }
+
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Can't map position file: %s\n", path);
+        return 0;
+    }
+
+    uint64_t count;
+    memcpy(&count, (uint8_t*)data + 8, sizeof(count));
+    if (memcmp(data, POSITIONS_MAGIC, 8) || (size - HEADER_SIZE) / sizeof(PackedPos) != count)
+    {
+        fprintf(stderr, "%s isn't a position file or it is truncated\n", path);
+        munmap(data, size);
+        return 0;
+    }
+    //The records are read once, in order
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const PackedPos* pos = (const PackedPos*)((uint8_t*)data + HEADER_SIZE);
+    *file = (PositionFile) {.pos = pos, .count = count, .data = data, .size = size};
+    return 1;
+}
+
+void closePositions(PositionFile* file)
+{
+    munmap(file->data, file->size);
+    *file = (PositionFile) {};
+}
+
+/* The number of positions is written by finishPositions
+ */
+FILE* createPositions(const char* path)
+{
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Can't create position file: %s\n", path);
+        return NULL;
+    }
+
+    const uint64_t count = 0;
+    fwrite(POSITIONS_MAGIC, 1, 8, fp);
+    fwrite(&count, sizeof(count), 1, fp);
+
+    return fp;
+}
+
+void writePositions(FILE* fp, const PackedPos* pos, const uint64_t n)
+{
+    fwrite(pos, sizeof(PackedPos), n, fp);
+}
+
+//Writes the number of positions and closes the file, returns 0 if it couldn't be written
+int finishPositions(FILE* fp)
+{
+    const long end = ftell(fp);
+    const uint64_t count = (uint64_t)(end - HEADER_SIZE) / sizeof(PackedPos);
+    const int ok = end >= HEADER_SIZE && !fseek(fp, 8, SEEK_SET) && fwrite(&count, sizeof(count), 1, fp) == 1;
+
+    return !fclose(fp) && ok;
+}
\ No newline at end of file
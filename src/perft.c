@@ -162,7 +162,7 @@ static NNUE dummy;
 
 void initDummy(void)
 {
-    dummy = (NNUE) {};
+    dummy = (NNUE) {.arch = {.halfDims = kHalfDimensionFT}};
     dummy.ftBiases = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT);
     dummy.ftWeights = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT*kInputDimensionsFT);
     CHECK_MALLOC(dummy.ftBiases);
@@ -28,14 +28,21 @@
 //Depth of the null move prunning
 #define R 3
 
+//Depth of the qsearch entries in the TT, below any depth of the main search
+#define QS_DEPTH_CHECK 0
+#define QS_DEPTH -1
+//Deepest entries of the main search that a qsearch node can replace
+#define QS_REPLACE_DEPTH 1
+
 
 static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* list, const int numMoves, Repetition rep);
-__attribute__((hot)) static int pvSearch(Board b, int alpha, int beta, int depth, const int height, int null, const uint64_t prevHash, Repetition* rep, const int isInC);
+static inline int pvSearch(Board b, const int alpha, const int beta, const int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC);
+__attribute__((hot)) static int searchPV(Board b, const int alpha, const int beta, const int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC);
+__attribute__((hot)) static int searchNonPV(Board b, const int alpha, const int beta, const int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC);
 
-static void internalIterDeepening(Board b, Move* list, const int numMoves, int alpha, const int beta, const int depth, const int height, const uint64_t prevHash, Repetition* rep);
 static int nullMove(Board b, const int depth, const int beta, const uint64_t prevHash);
 static inline int isDraw(const Board* b, const Repetition* rep, const uint64_t newHash, const int lastMCapture);
-static int evaluate(const Board* b);
+static int evaluate(const Board* b, const int alpha, const int beta, int* lazy);
 
 #ifdef USE_TB
 static Move tableLookUp(Board b, int* tbAv);
@@ -70,6 +77,13 @@ static int requestedExtraTime = 0;
 /* Info string */
 static uint64_t nodes = 0;
 
+static int lazyMargin = 0;
+#ifdef DEBUG
+//Evaluations with the NNUE and with fastEval instead of it, see evaluate
+static uint64_t nnueEvals = 0;
+static uint64_t lazyEvals = 0;
+#endif
+
 /* Debug info */
 static uint64_t noMoveGen = 0;
 static uint64_t repe = 0;
@@ -94,6 +108,10 @@ void initCall(void)
     noMoveGen = 0;
     exitFlag = 0;
     nodes = 0;
+    #ifdef DEBUG
+    nnueEvals = 0;
+    lazyEvals = 0;
+    #endif
     finishingTime = 0;
     requestedExtraTime = 0;
     foundBeforeTimesUp = 0;
@@ -247,12 +265,35 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
     printf("Researches: %llu\n", researches);
     printf("Repetitions: %llu\n", repe);
     printf("Queries: %llu\n", queries);
+    printf("SEE calls per node: %f\n", (double)seeCalls / nodes);
     #endif
 
     playWithTime = 0;
     return best;
 }
 
+uint64_t searchedNodes(void)
+{
+    return nodes;
+}
+
+#ifdef DEBUG
+//Evaluations of the last search done with the NNUE and the ones that were lazy
+void evalCounts(uint64_t* nnue, uint64_t* lazy)
+{
+    *nnue = nnueEvals;
+    *lazy = lazyEvals;
+}
+#endif
+
+/* Positions whose fastEval is margin or more outside of the window aren't evaluated with the NNUE,
+ * 0 always uses it
+ */
+void setLazyMargin(const int margin)
+{
+    lazyMargin = margin > 0? margin : 0;
+}
+
 static double percentage = 0;
 static Move moveStack[MAX_PLY+10]; //To avoid possible overflow errors
 static int evalStack[MAX_PLY+10];
@@ -270,9 +311,9 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
     int subtreeSize[NMOVES];
 
     initNNUEAcc(&b);
-    evalStack[0] = evaluate(&b);
+    int lazy;
+    evalStack[0] = evaluate(&b, MINS_INF, PLUS_INF, &lazy);
 
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
 
     int undo;
     for (int i = 0; i < numMoves; ++i)
@@ -298,7 +339,7 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
         }
         else
         {
-            updateDo(&q, list[i], &b);
+            updateDo(list[i], &b);
             undo = 1;
             addHash(&rep, newHash);
             if (i == 0)
@@ -307,7 +348,7 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
             }
             else
             {
-                val = -pvSearch(b, -alpha - 1, -alpha, depth - 1, 1, 0, newHash, &rep, inC);
+                val = -searchNonPV(b, -alpha - 1, -alpha, depth - 1, 1, 0, newHash, &rep, inC);
                 if (val > alpha)
                     val = -pvSearch(b, -beta, -alpha, depth - 1, 1, 0, newHash, &rep, inC);
             }
@@ -316,7 +357,7 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
 
         undoMove(&b, list[i], &h);
 
-        if (undo) updateUndo(&q, &b);
+        if (undo) updateUndo();
 
         //For the sorting at later depths
         list[i].score = val;
@@ -352,17 +393,34 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
     return currBest;
 }
 
+/* Types of node of the search, the body is instantiated once for each of them so the
+ * compiler can remove the branches that don't apply
+ */
+enum {NON_PV, PV};
+
+/* Searches with the instance that matches the window, use searchPV or searchNonPV
+ * directly when the type of the node is known
+ */
+static inline int pvSearch(Board b, const int alpha, const int beta, const int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
+{
+    if (beta - alpha > 1)
+        return searchPV(b, alpha, beta, depth, height, null, prevHash, rep, isInC);
+    else
+        return searchNonPV(b, alpha, beta, depth, height, null, prevHash, rep, isInC);
+}
+
 static const int marginDepth[4] = {0, 400, 600, 1200};
-static int pvSearch(Board b, int alpha, int beta, int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
+static inline __attribute__((always_inline)) int search(const int nodeType, Board b, int alpha, int beta, int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
 {
     assert(rep->index >= 0 && rep->index < 128);
     assert(beta >= alpha);
     assert(b.fifty >= 0);
     assert(height > 0 && height <= MAX_PLY);
     assert(depth >= 0);
+    assert(nodeType == (beta - alpha > 1));
 
     nodes++;
-    const int pv = beta - alpha > 1;
+    const int pv = nodeType == PV;
     const int index = prevHash % NUM_ENTRIES;
     assert(index >= 0 && index < NUM_ENTRIES);
 
@@ -405,12 +463,15 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         return alpha;
 
     if (height >= MAX_PLY)
-        return evaluate(&b);
+    {
+        int lazy;
+        return evaluate(&b, alpha, beta, &lazy);
+    }
 
     if (isInC && (depth < 5 || IS_CAP(moveStack[height-1])))
         depth++;
     else if (depth == 0)
-        return qsearch(b, alpha, beta, -1);
+        return qsearch(b, alpha, beta, -1, prevHash);
 
     int val, ttHit = 0, ev = MINS_INF;
     Move bestM = NO_MOVE;
@@ -441,12 +502,16 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         bestM = tableEntry->m;
         if (!isInC)
             ev = tableEntry->eval;
-        assert(bestM.from != -1);
-        ttHit = moveIsValidBasic(&b, &bestM);
+        //The qsearch entries may not have a move
+        ttHit = bestM.from != -1 && moveIsValidBasic(&b, &bestM);
     }
 
-    if (!(isInC || ttHit))
-        ev = evaluate(&b);
+    //The pruning margins and improving need the whole eval, it is also the one that goes to the table
+    if (!isInC && ev == MINS_INF)
+    {
+        int lazy;
+        ev = evaluate(&b, MINS_INF, PLUS_INF, &lazy);
+    }
     evalStack[height] = ev;
 
     assert((ev < PLUS_MATE && ev > MINS_MATE) || ev == MINS_INF);
@@ -460,7 +525,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         //Razoring
         if (depth == 1 && ev + V_ROOK[0] + 101 <= alpha)
         {
-            const int razScore = qsearch(b, alpha, beta, -1);
+            const int razScore = qsearch(b, alpha, beta, -1, prevHash);
             if (razScore >= beta)
                 return razScore;
         }
@@ -491,7 +556,6 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     const int newHeight = height + 1;
     History h;
 
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
     int undo = 0;
     int inC;
 /*
@@ -511,14 +575,14 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         }
         else
         {
-            updateDo(&q, bestM, &b);
+            updateDo(bestM, &b);
             undo = 1;
             addHash(rep, newHash);
             val = -pvSearch(b, -beta, -alpha, depth - 1, newHeight, null, newHash, rep, inC);
             remHash(rep);
         }
         undoMove(&b, bestM, &h);
-        if (undo) updateUndo(&q, &b);
+        if (undo) updateUndo();
 
         assert(val > best);
 
@@ -550,15 +614,17 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     const int improving = height > 1 && ev > evalStack[height-2] + 20 && !isInC && !null;
     const int notImproving = height > 1 && ev < evalStack[height-2] - 75 && !isInC && !null;
 
-    assignScores(&b, list, numMoves, bestM, depth);
-    sort(list, list+numMoves);
+    //Previous moves of the opponent and of the side to move, for the counter move and continuation history
+    const Move prevM = moveStack[height-1];
+    const Move prevM2 = height > 1? moveStack[height-2] : NO_MOVE;
 
-    int iid = 0;
-    if ((iid = (depth >= 5 && list[0].score < 290 && numMoves > 3)))
-    {
-        const int targD = pv? depth - 3 : depth / 3;
-        internalIterDeepening(b, list, numMoves, alpha, beta, targD, newHeight, prevHash, rep);
-    }
+    //Internal iterative reduction, without a move from the table the node is probably not that important
+    //and the ordering is worse, so it is searched with less depth, the next iteration will have a move
+    if (depth >= 5 && !ttHit)
+        depth--;
+
+    MovePicker mp;
+    initPicker(&mp, &b, list, numMoves, bestM, prevM, prevM2, depth);
 
     const int canBreak = depth <= 3 && ev + marginDepth[depth] <= alpha && !isInC;
     //const int fewMovesExt = b.stm != us && numMoves < 5;
@@ -571,7 +637,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         const int probBeta = beta + 160;
         for (int i = 0; i < numMoves; ++i)
         {
-            m = list[i];
+            m = pickMove(&mp, i);
             if (!IS_CAP(m))
                 continue;
 
@@ -584,12 +650,12 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
 
             inC = isInCheck(&b, b.stm);
             newHash = makeMoveHash(prevHash, &b, m, h);
-            updateDo(&q, m, &b);
+            updateDo(m, &b);
             addHash(rep, newHash);
 
-            val = -pvSearch(b, -probBeta, -probBeta+1, depth - 4, newHeight, null, newHash, rep, inC);
+            val = -searchNonPV(b, -probBeta, -probBeta+1, depth - 4, newHeight, null, newHash, rep, inC);
             undoMove(&b, m, &h);
-            updateUndo(&q, &b);
+            updateUndo();
             remHash(rep);
             assert(rep->index >= 0);
             assert(compMoves(&moveStack[height], &m) && moveStack[height].piece == m.piece);
@@ -603,29 +669,30 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
 
     const int prev = b.stm;
     assert(ttHit == 1 || ttHit == 0);
+    //Indices in list of the moves searched, the ones skipped by the pruning don't get history penalties.
+    //pickMove doesn't change the moves already picked so the indices stay valid
+    uint8_t searched[NMOVES];
+    int numSearched = 0;
     for (int i = /*ttHit*/0; i < numMoves; ++i)
     {
         undo = 0;
 
-        int SEEscore = 0;
-        m = list[i];
+        m = pickMove(&mp, i);
         moveStack[height] = m;
         assert(RANGE_64(m.from) && RANGE_64(m.to));
         if (canBreak && !IS_CAP(m) && (i > 3 + depth || (i > 3 && !pv)))
             break;
 
+        //SEE pruning, skip the captures that lose too much material
+        if (!isInC && depth <= 8 && best > MINS_MATE && IS_CAP(m) && m.piece != PAWN && !m.promotion
+            && !seeGE(&b, m, -80*depth*depth))
+            continue;
+
         assert(b.stm == prev);
         makeMove(&b, m, &h);
+        searched[numSearched++] = (uint8_t)i;
 
         inC = isInCheck(&b, b.stm);
-/*
-        if (0 && IS_CAP(m) && m.piece != PAWN && !inC) {
-            SEEscore = seeCapture(b, m);
-            if (depth <= 8 && best > MINS_MATE && SEEscore < -80*depth*depth){
-                continue;
-            }
-        }
-*/
         newHash = makeMoveHash(prevHash, &b, m, h);
 
         if (isDraw(&b, rep, newHash, IS_CAP(m)))
@@ -634,7 +701,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         }
         else
         {
-            updateDo(&q, m, &b);
+            updateDo(m, &b);
             undo = 1;
 
             addHash(rep, newHash);
@@ -668,9 +735,9 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
                 }
 
                 assert(depth - reduction >= 0);
-                val = -pvSearch(b, -alpha-1, -alpha, depth - reduction, newHeight, null, newHash, rep, inC);
+                val = -searchNonPV(b, -alpha-1, -alpha, depth - reduction, newHeight, null, newHash, rep, inC);
                 if (val > alpha && reduction > 1)
-                    val = -pvSearch(b, -alpha-1, -alpha, depth - 1, newHeight, null, newHash, rep, inC);
+                    val = -searchNonPV(b, -alpha-1, -alpha, depth - 1, newHeight, null, newHash, rep, inC);
                 if (pv && val > alpha && val < beta)
                     val = -pvSearch(b, -beta, -alpha, depth - 1, newHeight, null, newHash, rep, inC);
             }
@@ -681,7 +748,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         }
 
         undoMove(&b, m, &h);
-        if (undo) updateUndo(&q, &b);
+        if (undo) updateUndo();
 
         if (val > best)
         {
@@ -701,13 +768,19 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
                     if (!IS_CAP(bestM))
                     {
                         addHistory(bestM.from, bestM.to, depth*depth, b.stm);
+                        addContHistory(prevM, prevM2, bestM, depth*depth);
+                        addCounterMove(prevM, bestM, b.stm);
                         addKM(bestM, depth);
                     }
 
-                    if (depth < 6)
+                    for (int j = 0; j < numSearched - 1 && depth < 6; ++j)
                     {
-                        for (int j = 0; j < i; ++j)
-                            decHistory(list[j].from, list[j].to, (!IS_CAP(list[j]))*depth, b.stm);
+                        const Move tried = list[searched[j]];
+                        if (!IS_CAP(tried))
+                        {
+                            decHistory(tried.from, tried.to, depth, b.stm);
+                            decContHistory(prevM, prevM2, tried, depth);
+                        }
                     }
                     break;
                 }
@@ -728,25 +801,78 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     return best;
 }
 
-int qsearch(Board b, int alpha, const int beta, const int d)
+static int searchPV(Board b, const int alpha, const int beta, const int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
+{
+    return search(PV, b, alpha, beta, depth, height, null, prevHash, rep, isInC);
+}
+static int searchNonPV(Board b, const int alpha, const int beta, const int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
+{
+    return search(NON_PV, b, alpha, beta, depth, height, null, prevHash, rep, isInC);
+}
+
+/* Stores the result of a qsearch node, it only replaces the empty slots (depth 0), the qsearch entries
+ * and the main search entries of depth QS_REPLACE_DEPTH at most, whatever position they are from
+ */
+static inline void storeQsearch(Eval* tableEntry, const uint64_t hash, const int val, const int ev, const int depth, const int flag, const Move m)
+{
+    #ifndef TRAIN
+    if (tableEntry->depth <= QS_REPLACE_DEPTH)
+        *tableEntry = (Eval) {.key = hash, .m = m, .val = val, .eval = ev, .depth = depth, .flag = flag};
+    #endif
+}
+
+/* prevHash is only used to probe the table, which isn't used when training because
+ * the evaluation changes between calls
+ */
+int qsearch(Board b, int alpha, const int beta, const int d, const uint64_t prevHash)
 {
     assert(beta >= alpha);
     #ifdef DEBUG
     ++qsearchNodes;
     #endif
 
+    const int origAlpha = alpha;
+    int score = MINS_INF;
+
+    #ifdef TRAIN
+    Eval* tableEntry = NULL;
+    #else
+    Eval* tableEntry = &table[prevHash % NUM_ENTRIES];
+    if (tableEntry->key == prevHash)
+    {
+        assert(hashPosition(&b) == tableEntry->key);
+        const int val = tableEntry->val;
+        if (abs(val) < PLUS_MATE - 200)
+        {
+            if (tableEntry->flag == EXACT || (tableEntry->flag == LO && val >= beta) || (tableEntry->flag == HI && val <= alpha))
+                return max(alpha, min(beta, val));
+        }
+        score = tableEntry->eval;
+    }
+    #endif
+
     //int score = fastEval(&b);
     //if (abs(score) <= V_QUEEN)
-    const int score = evaluate(&b);
+    int lazy = 0;
+    if (score == MINS_INF)
+        score = evaluate(&b, alpha, beta, &lazy);
+    //A lazy stand pat is only good for this window, the table keeps MINS_INF as the static eval
+    const int staticEval = lazy? MINS_INF : score;
 
     assert(score > MINS_MATE + 200 && score < PLUS_MATE - 200);
 
     if (score >= beta)
+    {
+        storeQsearch(tableEntry, prevHash, beta, staticEval, QS_DEPTH, LO, NO_MOVE);
         return beta;
+    }
     else if (score > alpha)
         alpha = score;
     else if (score + V_QUEEN[0] <= alpha)
+    {
+        storeQsearch(tableEntry, prevHash, alpha, staticEval, QS_DEPTH, HI, NO_MOVE);
         return alpha;
+    }
 
     if (d == 0)
         return alpha;
@@ -754,91 +880,64 @@ int qsearch(Board b, int alpha, const int beta, const int d)
     Move list[NMOVES];
     const int nMvsAndChck = legalMovesQuiesce(&b, list);
     const int numMoves = nMvsAndChck >> 1;
+    //All the evasions are searched when in check
+    const int depth = (nMvsAndChck & 1)? QS_DEPTH_CHECK : QS_DEPTH;
     History h;
 
-    assignScoresQuiesce(&b, list, numMoves);
-    sort(list, list+numMoves);
+    MovePicker mp;
+    initPickerQuiesce(&mp, &b, list, numMoves);
 
     int val;
+    Move m, bestM = NO_MOVE;
+    uint64_t newHash;
 
     int undo = 0;
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
 
     for (int i = 0; i < numMoves; ++i)
     {
         undo = 0;
-        if (!(nMvsAndChck & 1) && i > 2 && list[i].score + score < alpha)
+        m = pickMove(&mp, i);
+        if (!(nMvsAndChck & 1) && i > 2 && m.score + score < alpha)
+            break;
+        //The captures are ordered by SEE, from here on all of them lose material
+        if (!(nMvsAndChck & 1) && m.score < 0)
             break;
 
-        makeMove(&b, list[i], &h);
+        makeMove(&b, m, &h);
 
         if (insuffMat(&b)) //No need to check for 3 fold rep
             val = 0;
         else
         {
-            updateDo(&q, list[i], &b);
+            #ifdef TRAIN
+            newHash = 0;
+            #else
+            newHash = makeMoveHash(prevHash, &b, m, h);
+            #endif
+            updateDo(m, &b);
             undo = 1;
-            val = -qsearch(b, -beta, -alpha, d - 1 /*+ (list[i].capture < 3)*/);
+            val = -qsearch(b, -beta, -alpha, d - 1 /*+ (m.capture < 3)*/, newHash);
         }
 
-        undoMove(&b, list[i], &h);
+        undoMove(&b, m, &h);
 
-        if (undo) updateUndo(&q, &b);
+        if (undo) updateUndo();
 
         if (val > alpha)
         {
             alpha = val;
+            bestM = m;
             if (val >= beta)
+            {
+                storeQsearch(tableEntry, prevHash, beta, staticEval, depth, LO, m);
                 return beta;
+            }
         }
     }
 
-    return alpha;
-}
-
-/* In this function there are no assumptions made about the sorting of the list
- */
-static void internalIterDeepening(Board b, Move* list, const int numMoves, int alpha, const int beta, const int depth, const int height, const uint64_t prevHash, Repetition* rep)
-{
-    assert(beta >= alpha);
-    assert(depth >= 1);
-    assert(height > 0 && height <= MAX_PLY);
-
-    uint64_t newHash;
-    int val;
-
-    History h;
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
-
-    int undo;
-    for (int i = 0; i < numMoves; ++i)
-    {
-        undo = 0;
+    storeQsearch(tableEntry, prevHash, alpha, staticEval, depth, alpha > origAlpha? EXACT : HI, bestM);
 
-        makeMove(&b, list[i], &h);
-
-        newHash = makeMoveHash(prevHash, &b, list[i], h);
-
-        if (isDraw(&b, rep, newHash, IS_CAP(list[i])))
-        {
-            val = 0;
-        }
-        else
-        {
-            updateDo(&q, list[i], &b);
-            undo = 1;
-            addHash(rep, newHash);
-            val = -pvSearch(b, -beta, -alpha, depth - 1, height, 1, newHash, rep, isInCheck(&b, b.stm));
-            remHash(rep);
-        }
-
-        list[i].score = val;
-
-        undoMove(&b, list[i], &h);
-        if (undo) updateUndo(&q, &b);
-    }
-
-    sort(list, list+numMoves);
+    return alpha;
 }
 
 #ifdef USE_TB
@@ -906,7 +1005,9 @@ static int nullMove(Board b, const int depth, const int beta, const uint64_t pre
     Repetition _rep = (Repetition) {.index = 0};
     b.stm ^= 1;
     const int td = (depth < 6)? depth - R : depth / 3 + 1;
-    const int val = -pvSearch(b, -beta, -beta + 1, td, MAX_PLY - 15, 1, changeTurn(prevHash), &_rep, 0);
+    //The null search doesn't continue the previous moves
+    moveStack[MAX_PLY - 16] = moveStack[MAX_PLY - 17] = NO_MOVE;
+    const int val = -searchNonPV(b, -beta, -beta + 1, td, MAX_PLY - 15, 1, changeTurn(prevHash), &_rep, 0);
     b.stm ^= 1;
 
     return val >= beta;
@@ -930,12 +1031,37 @@ static inline int isDraw(const Board* b, const Repetition* rep, const uint64_t n
 }
 
 static const int SEARCH_TEMPO = 11;
-static int evaluate(const Board* b)
+/* In lopsided positions the material and the psts already decide whether the node fails high or low,
+ * if fastEval is lazyMargin outside of [alpha, beta] it is used and the NNUE isn't called.
+ * The accumulator of the ply isn't computed then, the next evaluation updates it from the last computed one.
+ * Such a score is flagged as lazy so it isn't kept in the table
+ */
+static int evaluate(const Board* b, const int alpha, const int beta, int* lazy)
 {
+    *lazy = 0;
     #ifdef USE_NNUE
-    int ev = SEARCH_TEMPO + evaluateNNUE(b, 1);
+    int ev;
+    const int fast = lazyMargin? fastEval(b) : 0;
+    if (lazyMargin && (fast - lazyMargin >= beta || fast + lazyMargin <= alpha))
+    {
+        ev = fast;
+        *lazy = 1;
+        #ifdef DEBUG
+        ++lazyEvals;
+        #endif
+    }
+    else
+    {
+        ev = SEARCH_TEMPO + evaluateNNUE(b, 1);
+        #ifdef DEBUG
+        ++nnueEvals;
+        #endif
+    }
+    #elif defined(TRAIN)
+    //The tuner needs the exact score of every leaf
+    int ev = eval(b, MINS_INF, PLUS_INF, lazy);
     #else
-    int ev = eval(b);
+    int ev = eval(b, alpha, beta, lazy);
     #endif
 
     ev = ev * (100 - b->fifty) / 100;
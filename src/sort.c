@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <math.h>
 #include <time.h>
+#include <string.h>
 
 #include "../include/global.h"
 #include "../include/board.h"
@@ -19,18 +20,25 @@
 #include "../include/evaluation.h"
 
 int history[2][4096];
-
-static int smallestAttackerSqr(const Board* b, const int sqr, const int col, const uint64_t diag, const uint64_t stra);
-__attribute__((hot)) static int see(Board* b, const int to, const int pieceAtSqr, const uint64_t diag, const uint64_t stra);
+//[plies since prev][prev piece][prev to][piece][to], for the previous two moves
+int contHistory[2][6][64][6][64];
 
 #define NUM_KM 2
 
+//State of the score of a move in the MovePicker
+enum {SEE_DONE, SEE_PENDING};
+
 static Move NOMOVE = (Move) {.from = -1, .to = -1};
 static int pVal[6];
 Move killerMoves[MAX_PLY][NUM_KM];
 
+//Quiet move that refuted the previous move, indexed by its from and to
 Move counterMove[2][4096];
 
+#ifdef DEBUG
+uint64_t seeCalls = 0;
+#endif
+
 inline int compMoves(const Move* m1, const Move* m2)
 {
     return m1->from == m2->from && m1->to == m2->to;
@@ -56,85 +64,146 @@ void initKM(void)
     }
 }
 
-int seeCapture(Board b, const Move m)
+/* Returns the bb of the pieces of both colors that attack sqr, only the pieces in
+ * occ are considered to be on the board
+ */
+static inline uint64_t attackersTo(const Board* b, const int sqr, const uint64_t occ)
 {
-    makePermaMove(&b, m);
-    return pVal[m.capture] - see(&b, m.to, m.piece, getDiagMoves(m.to), getStraMoves(m.to));
+    const uint64_t diagSliders = b->piece[WHITE][BISH] | b->piece[BLACK][BISH] | b->piece[WHITE][QUEEN] | b->piece[BLACK][QUEEN];
+    const uint64_t straSliders = b->piece[WHITE][ROOK] | b->piece[BLACK][ROOK] | b->piece[WHITE][QUEEN] | b->piece[BLACK][QUEEN];
+
+    return ((getBlackPawnCaptures(sqr) & b->piece[WHITE][PAWN])
+        |   (getWhitePawnCaptures(sqr) & b->piece[BLACK][PAWN])
+        |   (getKnightMoves(sqr) & (b->piece[WHITE][KNIGHT] | b->piece[BLACK][KNIGHT]))
+        |   (getKingMoves(sqr) & (b->piece[WHITE][KING] | b->piece[BLACK][KING]))
+        |   (getBishMagicMoves(sqr, occ) & diagSliders)
+        |   (getRookMagicMoves(sqr, occ) & straSliders)) & occ;
 }
-static int see(Board* b, const int sqr, const int pieceAtSqr, const uint64_t diag, const uint64_t stra)
-{
-    const int col = b->stm;
-    const int from = smallestAttackerSqr(b, sqr, 1 ^ col, diag, stra);
 
-    int value = 0;
+/* Adds the sliders that attack sqr once a piece in the same line has been removed from occ
+ */
+static inline uint64_t xrays(const Board* b, const int sqr, const uint64_t occ, const int piece)
+{
+    uint64_t att = 0;
+    if (piece == PAWN || piece == BISH || piece == QUEEN)
+        att |= getBishMagicMoves(sqr, occ) & (b->piece[WHITE][BISH] | b->piece[BLACK][BISH] | b->piece[WHITE][QUEEN] | b->piece[BLACK][QUEEN]);
+    if (piece == ROOK || piece == QUEEN)
+        att |= getRookMagicMoves(sqr, occ) & (b->piece[WHITE][ROOK] | b->piece[BLACK][ROOK] | b->piece[WHITE][QUEEN] | b->piece[BLACK][QUEEN]);
+    return att;
+}
 
-    if (from != -1)
+/* Returns the least valuable piece of color col in attackers and its bit in lvaBit,
+ * NO_PIECE if there is none
+ */
+static inline int leastValuable(const Board* b, const uint64_t attackers, const int col, uint64_t* lvaBit)
+{
+    for (int piece = PAWN; piece >= KING; --piece)
     {
-        const int attacker = pieceAt(b, POW2[from], col);
-
-        const Move move = (Move){.from=from, .to=sqr, .piece=attacker, .capture=pieceAtSqr, .castle=0};
-
-        makePermaMove(b, move);
-        const int score = pVal[pieceAtSqr] - see(b, sqr, attacker, diag, stra);
-        value = (score > 0)? score : 0;
+        const uint64_t bb = attackers & b->piece[col][piece];
+        if (bb)
+        {
+            *lvaBit = bb & -bb;
+            return piece;
+        }
     }
 
-    return value;
+    return NO_PIECE;
 }
 
-static int smallestAttackerSqr(const Board* b, const int sqr, const int col, const uint64_t diag, const uint64_t stra)
+/* Static exchange evaluation of a capture using a swap list, the board isn't modified.
+ * gain[d] is the score from the pov of the side that captures at depth d, assuming
+ * the piece on the sqr is going to be recaptured
+ */
+int seeCapture(const Board* b, const Move m)
 {
-    const int opp = 1 ^ col;
-    const uint64_t obst = b->allPieces;
-
-    uint64_t temp = 0, bishMag = 0, rookMag = 0;
-    if (col)
-    {
-        temp = getWhitePawnCaptures(sqr) & b->piece[BLACK][PAWN];
-        if (temp)
-            return LSB_INDEX(temp);
-    }
-    else
+    #ifdef DEBUG
+    ++seeCalls;
+    #endif
+    int gain[34], d = 0;
+    int col = b->stm, piece = m.piece;
+    uint64_t fromBit = POW2[m.from];
+    uint64_t occ = b->allPieces;
+    uint64_t attackers = attackersTo(b, m.to, occ);
+
+    gain[0] = pVal[m.capture];
+    do
     {
-        temp = getBlackPawnCaptures(sqr) & b->piece[WHITE][PAWN];
-        if (temp)
-            return LSB_INDEX(temp);
-    }
+        d++;
+        gain[d] = pVal[piece] - gain[d-1]; //Speculative, in case the piece is captured
 
-    temp = getKnightMoves(sqr) & b->piece[opp][KNIGHT];
-    if (temp)
-        return LSB_INDEX(temp);
+        occ ^= fromBit;
+        attackers = (attackers | xrays(b, m.to, occ, piece)) & occ;
+        col ^= 1;
 
-    if ((b->piece[opp][BISH] | b->piece[opp][QUEEN]) & diag)
-        bishMag = getBishMagicMoves(sqr, obst);
+        piece = leastValuable(b, attackers, col, &fromBit);
+        //The king can't capture a defended piece
+        if (piece == KING && (attackers & b->color[1 ^ col]))
+            break;
+    } while (piece != NO_PIECE);
 
-    temp = bishMag & b->piece[opp][BISH];
-    if (temp)
-        return LSB_INDEX(temp);
+    while (--d)
+        gain[d-1] = -max(-gain[d-1], gain[d]);
 
-    if ((b->piece[opp][ROOK] | b->piece[opp][QUEEN]) & stra)
-        rookMag = getRookMagicMoves(sqr, obst);
+    return gain[0];
+}
 
-    temp = rookMag & b->piece[opp][ROOK];
-    if (temp)
-        return LSB_INDEX(temp);
+/* Returns if seeCapture(b, m) >= threshold, it is faster than calculating the SEE
+ * because it stops as soon as the result is known
+ */
+int seeGE(const Board* b, const Move m, const int threshold)
+{
+    #ifdef DEBUG
+    ++seeCalls;
+    #endif
+    int swap = (IS_CAP(m)? pVal[m.capture] : 0) - threshold;
+    if (swap < 0)
+        return 0;
+
+    swap = pVal[m.piece] - swap;
+    if (swap <= 0)
+        return 1;
+
+    uint64_t occ = b->allPieces ^ POW2[m.from] ^ POW2[m.to];
+    uint64_t attackers = attackersTo(b, m.to, occ);
+    uint64_t lvaBit = 0;
+    int col = b->stm, res = 1, piece;
+
+    while (1)
+    {
+        col ^= 1;
+        attackers &= occ;
+        if (!(attackers & b->color[col]))
+            break;
 
-    temp = (bishMag | rookMag) & b->piece[opp][QUEEN];
-    if (temp)
-        return LSB_INDEX(temp);
+        res ^= 1;
+        piece = leastValuable(b, attackers, col, &lvaBit);
 
-    temp = getKingMoves(sqr) & b->piece[opp][KING];
-    if (temp)
-        return LSB_INDEX(temp);
+        //The king can only capture if the opp has no attackers left
+        if (piece == KING)
+            return (attackers & b->color[1 ^ col])? res ^ 1 : res;
 
-    return -1;
+        if ((swap = pVal[piece] - swap) < res)
+            break;
+
+        occ ^= lvaBit;
+        attackers |= xrays(b, m.to, occ, piece);
+    }
+
+    return res;
 }
 
-//TODO: Set a flag to use SEE depending on the depth or sthng like that
-inline void assignScores(Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth)
+/* Assigns the scores to the moves, if lazy isn't NULL the SEE of the captures isn't
+ * calculated, instead they get an upper bound and are flagged so that pickMove can
+ * calculate it only if they are about to be searched
+ */
+static void scoreMoves(const Board* b, Move* list, const int numMoves, const Move bestFromPos, const Move prev, const Move prev2, const int depth, char* lazy)
 {
     Move* end = list + numMoves;
 
+    const int (*cont1)[64] = prev.from == -1? NULL : contHistory[0][prev.piece][prev.to];
+    const int (*cont2)[64] = prev2.from == -1? NULL : contHistory[1][prev2.piece][prev2.to];
+    const Move counter = prev.from == -1? NOMOVE : counterMove[b->stm][BASE_64(prev.from, prev.to)];
+
     uint64_t pawnAtt;
     if (b->stm)
         pawnAtt = BLACK_PAWN_ATT(b->piece[BLACK][PAWN]);
@@ -148,24 +217,27 @@ inline void assignScores(Board* b, Move* list, const int numMoves, const Move be
             continue;
         if(IS_CAP(*curr)) //There has been a capture
         {
-            /*
-            //Simple MVV-LVA
-            int subst = (curr->piece < ROOK)? pVal[ROOK] / 7 : pVal[curr->piece] / 10;
-            curr->score = pVal[curr->capture] - subst;
-            */
-            //SEE
+            //SEE, a pawn can't lose material when capturing, and the king can't capture defended pieces
             if (curr->piece == PAWN)
                 curr->score = pVal[curr->capture];
             else if (curr->piece == KING)
                 curr->score = pVal[curr->capture] - 5;
+            else if (lazy)
+            {
+                //seeCapture <= pVal[capture], so this is an upper bound
+                curr->score = 69 + pVal[curr->capture];
+                lazy[curr - list] = SEE_PENDING;
+            }
             else
-                curr->score = 69 + seeCapture(*b, *curr);
+                curr->score = 69 + seeCapture(b, *curr);
         }
         else
         {
             if (pawnAtt & (1ULL << curr->to))
                 curr->score -= 25 - 2*curr->piece;
             int add = history[b->stm][BASE_64(curr->from, curr->to)];
+            if (cont1) add += cont1[curr->piece][curr->to] / 2;
+            if (cont2) add += cont2[curr->piece][curr->to] / 2;
             if (add > 0)
                 add = (int)sqrt(add) / 2;
             else
@@ -183,6 +255,8 @@ inline void assignScores(Board* b, Move* list, const int numMoves, const Move be
                 curr->score += 59;
             else if (compMoves(&killerMoves[depth][1], curr))
                 curr->score += 58;
+            else if (!IS_CAP(*curr) && compMoves(&counter, curr))
+                curr->score += 57;
         }
         /*
         if (curr->score < 300)
@@ -194,7 +268,7 @@ inline void assignScores(Board* b, Move* list, const int numMoves, const Move be
         */
     }
 }
-inline void assignScoresQuiesce(Board* b, Move* list, const int numMoves)
+static void scoreMovesQuiesce(const Board* b, Move* list, const int numMoves, char* lazy)
 {
     Move* end = list + numMoves;
     for (Move* curr = list; curr != end; ++curr)
@@ -205,11 +279,87 @@ inline void assignScoresQuiesce(Board* b, Move* list, const int numMoves)
             //TODO: That could be improved using bbs of the last pieces moved
             if (curr->piece == KING)
                 curr->score = pVal[curr->capture];
+            else if (lazy)
+            {
+                //seeCapture <= pVal[capture], so this is an upper bound
+                curr->score = pVal[curr->capture];
+                lazy[curr - list] = SEE_PENDING;
+            }
             else
-                curr->score = seeCapture(*b, *curr);
+                curr->score = seeCapture(b, *curr);
         }
     }
 }
+
+//TODO: Set a flag to use SEE depending on the depth or sthng like that
+inline void assignScores(Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth)
+{
+    scoreMoves(b, list, numMoves, bestFromPos, NOMOVE, NOMOVE, depth, NULL);
+}
+inline void assignScoresQuiesce(Board* b, Move* list, const int numMoves)
+{
+    scoreMovesQuiesce(b, list, numMoves, NULL);
+}
+
+void initPicker(MovePicker* mp, const Board* b, Move* list, const int numMoves, const Move bestFromPos, const Move prev, const Move prev2, const int depth)
+{
+    assert(numMoves <= NMOVES);
+    mp->list = list;
+    mp->b = b;
+    mp->numMoves = numMoves;
+    memset(mp->lazy, 0, (size_t)numMoves);
+    scoreMoves(b, list, numMoves, bestFromPos, prev, prev2, depth, mp->lazy);
+}
+void initPickerQuiesce(MovePicker* mp, const Board* b, Move* list, const int numMoves)
+{
+    assert(numMoves <= NMOVES);
+    mp->list = list;
+    mp->b = b;
+    mp->numMoves = numMoves;
+    memset(mp->lazy, 0, (size_t)numMoves);
+    scoreMovesQuiesce(b, list, numMoves, mp->lazy);
+}
+
+/* Places the move with the largest score of [idx, numMoves) in idx and returns it,
+ * the moves before idx aren't modified so they are the moves that have been picked.
+ * If the best move still has to check the SEE it is done and the selection repeated,
+ * since the lazy scores are upper bounds the scores returned are non increasing
+ */
+Move pickMove(MovePicker* mp, const int idx)
+{
+    assert(idx < mp->numMoves);
+    Move* list = mp->list;
+    int best;
+
+    while (1)
+    {
+        best = idx;
+        for (int i = idx + 1; i < mp->numMoves; ++i)
+        {
+            if (list[i].score > list[best].score)
+                best = i;
+        }
+
+        if (!mp->lazy[best])
+            break;
+
+        Move* m = &list[best];
+        m->score -= pVal[m->capture] - seeCapture(mp->b, *m);
+        mp->lazy[best] = SEE_DONE;
+    }
+
+    //Shift instead of swapping to keep the order of the ties, as the insertion sort did
+    if (best != idx)
+    {
+        const Move tmp = list[best];
+        memmove(list + idx + 1, list + idx, (size_t)(best - idx) * sizeof(Move));
+        memmove(mp->lazy + idx + 1, mp->lazy + idx, (size_t)(best - idx));
+        list[idx] = tmp;
+        mp->lazy[idx] = SEE_DONE;
+    }
+
+    return list[idx];
+}
 inline void addKM(const Move m, const int depth)
 {
     killerMoves[depth][0] = killerMoves[depth][1];
@@ -231,6 +381,31 @@ inline void decHistory(const int from, const int to, const int n, const int stm)
     if (*h < -7000)
         *h/=10;
 }
+inline void addCounterMove(const Move prev, const Move m, const int stm)
+{
+    if (prev.from != -1)
+        counterMove[stm][BASE_64(prev.from, prev.to)] = m;
+}
+static inline void updateContEntry(int* h, const int n)
+{
+    *h+=n;
+    if (*h > 7000 || *h < -7000)
+        *h/=10;
+}
+/* Moves that are not available (root or after a null move) have from == -1
+ */
+inline void addContHistory(const Move prev, const Move prev2, const Move m, const int n)
+{
+    assert(RANGE_64(m.to) && !IS_CAP(m));
+    if (prev.from != -1)
+        updateContEntry(&contHistory[0][prev.piece][prev.to][m.piece][m.to], n);
+    if (prev2.from != -1)
+        updateContEntry(&contHistory[1][prev2.piece][prev2.to][m.piece][m.to], n);
+}
+inline void decContHistory(const Move prev, const Move prev2, const Move m, const int n)
+{
+    addContHistory(prev, prev2, m, -n);
+}
 void initHistory(void)
 {
     int* end = history[0] + 4096;
@@ -239,6 +414,13 @@ void initHistory(void)
         *p = 0;
         *q = 0;
     }
+
+    #ifdef DEBUG
+    seeCalls = 0;
+    #endif
+    memset(contHistory, 0, sizeof(contHistory));
+    for (int i = 0; i < 4096; ++i)
+        counterMove[BLACK][i] = counterMove[WHITE][i] = NOMOVE;
 }
 
 /* Moves the largest score to the beggining of the list
@@ -3,22 +3,34 @@
  * labled positions.
  */
 
+#ifdef TRAIN
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
 
 #include "../include/global.h"
 #include "../include/train.h"
 #include "../include/board.h"
 #include "../include/moves.h"
+#include "../include/allmoves.h"
+#include "../include/boardmoves.h"
 #include "../include/hash.h"
 #include "../include/search.h"
 #include "../include/evaluation.h"
 #include "../include/nnue.h"
+#include "../include/io.h"
+#include "../include/packedpos.h"
 
 #define NUM_VARS 20
+#define LEAF_DEPTH 7
+#define LEAF_CHUNK 256
+#define GRAD_CHUNK 1024
 
 
 typedef struct
@@ -30,9 +42,38 @@ typedef struct
 
 typedef struct
 {
-    char fen[150];
-    double result;
-} FenResult;
+    int16_t var;
+    int16_t coeff;
+} Coeff;
+
+/* A quiet leaf as a linear function of the values, see mthLeaves.
+ * Each variable appears at most once, and floats are precise enough for the scores.
+ * The coefficients are in the pool of its chunk of LEAF_CHUNK positions (chunkCoeffs),
+ * most positions only have a few of them so they aren't stored with a fixed size
+ */
+typedef struct
+{
+    float base[2]; //The part of [OP, EG] that isn't tuned
+    float offset;
+    const Coeff* coeffs;
+    uint8_t ph;
+    uint8_t n;
+    uint8_t result; //RESULT_NONE if the leaf isn't used
+    uint8_t fifty;
+} TunePos;
+
+/* The error and gradient of GRAD_CHUNK positions, the workers take them until there are none left
+ * and they are added in order, so the result doesn't depend on the threads
+ */
+typedef struct
+{
+    int beg;
+    int end;
+    const double* theta;
+
+    double error;
+    double grad[2*NUM_VARS];
+} Job;
 
 
 static ReadInt getNext(FILE* fp);
@@ -40,22 +81,59 @@ static void setArray(const int* arr);
 static void saveArray(const int* arr);
 static void optimize(void);
 static void loadFensIntoMem(void);
-static double error(void);
+static void convertFens(void);
+static void writeQuietLeaves(void);
+static double error(const double* theta, const int beg, const int end, double* grad);
 
 /* static vars */
-static int num_thr = 2; //Number of threads
-static int num_pos = 100; //To count the number of positions run $ wc -l /../fen.csv
+static int num_thr = 0; //Number of threads, 0 for all the cores
+static int num_pos = 0; //Maximum number of positions, 0 for all of them
 static int val_lim = 1500; //To ensure that no value gets too high
+static int num_epochs = 100;
+static int batch_size = 16384;
+static double learning_rate = 1;
+static int quietPass = 0; //Write the quiet leaves of fen.csv into quiet.csv instead of training
+static int quietFens = 0; //Train with quiet.csv, whose positions are already quiet
+static int binFiles = 0;  //Use the binary files (fen.bin, quiet.bin) instead of the csv ones
+static int convert = 0;   //Convert the csv file into the binary one instead of training
+
+static int nextPos = 0;   //First position of the next chunk to resolve
+static int corrupt = 0;   //Records of the binary files that aren't valid
+static int inCheck = 0;   //Leaves that are dropped
+static int noMoves = 0;
+static int notQuiet = 0;
+static int checkFens = 0; //Positions of the csv files that are skipped because they are in check
+
+//The workers of the gradient, they wait for each batch in batchStart
+static pthread_t* workers;
+static pthread_barrier_t batchStart, batchDone;
+static Job* jobs;
+static int numJobs = 0;
+static int nextJob = 0;
+static int stopWorkers = 0;
 
 static char fenFile[256];  //File with the fens and results
 static char saveFile[256]; //File where the optimum values will be placed
 static char valFile[256];  //File that contains the initial values
-
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static char quietFile[256]; //File with the quiet leaves of fenFile
+static char binFile[256];  //Binary version of fenFile
 
 static int vals[2*NUM_VARS];     //The values of the variables
-static FenResult* positions;   //Array that holds the fens+results in memory, this is much faster than reading from the hard drive
-static double* acc;            //Accumulators for the different threads
+static const PackedPos* positions; //The positions with their results, either parsed from the csv or the mapped binary file
+static PackedPos* parsed;          //The positions of the csv file
+static PositionFile posFile;
+static PackedPos* leaves;          //The quiet leaves of the positions in the quiet pass
+static TunePos* tunePos;       //The positions in linear form
+static Coeff** chunkCoeffs;    //The coefficients of the positions of each chunk
+static long numCoeffs = 0;
+
+//The variables in the order of Values.txt
+static int* const params[NUM_VARS] = {
+    V_QUEEN, V_ROOK, V_BISH, V_KNIGHT,
+    CONNECTED_ROOKS, ROOK_OPEN_FILE, SAFE_KING, BISH_PAIR, KNIGHT_PAWNS, N_KING_OPEN_FILE,
+    PAWN_CHAIN, PAWN_PROTECTION_BISH, PAWN_PROTECTION_KNIG, ATTACKED_BY_PAWN, N_DOUBLED_PAWNS, QUEEN_CHECKS, N_ISOLATED_PAWN,
+    BISH_MOB, KNIG_MOB, PIECES_MOV
+};
 
 static char* help_msg = 
 "Module to tune engine evaluation parametres\n"
@@ -63,9 +141,17 @@ static char* help_msg =
 "The params are:\n"
 " -h: display help msg\n"
 " -l: variable limit\n"
-" -c: number of threads\n"
-" -p: number of positions\n"
-"Eg.: ./t /home/usr/chess -c 3 -p 400000";
+" -c: number of threads, all the cores by default\n"
+" -p: maximum number of positions, all of them by default\n"
+" -e: number of epochs\n"
+" -b: batch size\n"
+" -r: learning rate (cp per step)\n"
+" -q: don't train, resolve fen.csv to the quiet leaves of its qsearch and write them into quiet.csv\n"
+" -s: train with quiet.csv instead of fen.csv, its positions aren't resolved again\n"
+" -w: don't train, convert fen.csv (quiet.csv with -s) into fen.bin (quiet.bin)\n"
+" -m: use the binary files instead of the csv ones, they are mapped into memory without parsing\n"
+"Build it with NNUE=no, the hand crafted eval is the one tuned\n"
+"Eg.: ./t /home/usr/chess -c 3 -p 400000 -e 50";
 
 
 static const int isNumeric(char c)
@@ -100,23 +186,53 @@ void setVariables(const int argc, char** const argv)
                 printf("[-] Invalid arg %s\n", argv[i+1]);
                 exit(EXIT_FAILURE);
             }
+        } else if (strncmp(argv[i], "-e", 2) == 0) { //Number of epochs
+            num_epochs = atoi(argv[i+1]);
+            if (num_epochs <= 0){
+                printf("[-] Invalid arg %s\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "-b", 2) == 0) { //Batch size
+            batch_size = atoi(argv[i+1]);
+            if (batch_size <= 0){
+                printf("[-] Invalid arg %s\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "-r", 2) == 0) { //Learning rate
+            learning_rate = atof(argv[i+1]);
+            if (learning_rate <= 0){
+                printf("[-] Invalid arg %s\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "-q", 2) == 0) { //Quiet leaves pass
+            quietPass = 1;
+        } else if (strncmp(argv[i], "-s", 2) == 0) { //Train with the quiet leaves
+            quietFens = 1;
+        } else if (strncmp(argv[i], "-w", 2) == 0) { //Convert the csv into the binary file
+            convert = 1;
+        } else if (strncmp(argv[i], "-m", 2) == 0) { //Binary files
+            binFiles = 1;
         } else if (strncmp(argv[i], "-h", 2) == 0) { //Show help message
             printf("%s\n", help_msg);
             exit(EXIT_SUCCESS);
         }
     }
 
-    positions = malloc(num_pos * sizeof(FenResult));
-    CHECK_MALLOC(positions);
-    acc = malloc(num_thr * sizeof(double));
-    CHECK_MALLOC(acc);
+    if (num_thr == 0)
+        num_thr = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_pos == 0)
+        num_pos = INT_MAX;
 }
 
 /* Reads all the info from path and parses the values that will be used
  */
 void readValues(const char* path)
 {
-    sprintf(fenFile,  "%s/fen.csv",     path);
+    const char* name = quietFens? "quiet" : "fen";
+    const char* ext = binFiles? "bin" : "csv";
+    sprintf(fenFile,  "%s/%s.%s",       path, name, ext);
+    sprintf(binFile,  "%s/%s.bin",      path, name);
+    sprintf(quietFile, "%s/quiet.%s",   path, ext);
     sprintf(valFile,  "%s/Values.txt",  path);
     sprintf(saveFile, "%s/opt.txt",     path);
 
@@ -129,9 +245,16 @@ void readValues(const char* path)
         exit(EXIT_FAILURE);
     }
 
+    //The ones that aren't in the file keep the values of the engine
+    for (int i = 0; i < NUM_VARS; ++i)
+    {
+        vals[2*i] = params[i][0];
+        vals[2*i+1] = params[i][1];
+    }
+
     ReadInt r;
     int i = 0;
-    while((r = getNext(fp)).successful)
+    while(i < 2*NUM_VARS && (r = getNext(fp)).successful)
     {
         vals[i++] = r.valueMG;
         vals[i++] = r.valueEG;
@@ -144,16 +267,35 @@ void readValues(const char* path)
 
 void txlTrain(void)
 {
-    loadFensIntoMem();
-    if (pthread_mutex_init(&mutex, NULL) != 0) {
-        printf("Can't generate mutex\n");
+    if (convert)
+    {
+        convertFens();
         return;
-    } else
-        printf("[+] Mutex initialized successfully\n");
-    optimize();
+    }
 
-    free(positions);
-    free(acc);
+    loadFensIntoMem();
+    if (quietPass)
+        writeQuietLeaves();
+    else
+    {
+        const int numChunks = (num_pos + LEAF_CHUNK - 1) / LEAF_CHUNK;
+        tunePos = malloc(num_pos * sizeof(TunePos));
+        chunkCoeffs = malloc(numChunks * sizeof(Coeff*));
+        CHECK_MALLOC(tunePos);
+        CHECK_MALLOC(chunkCoeffs);
+
+        optimize();
+
+        for (int i = 0; i < numChunks; ++i)
+            free(chunkCoeffs[i]);
+        free(chunkCoeffs);
+        free(tunePos);
+    }
+
+    if (binFiles)
+        closePositions(&posFile);
+    else
+        free(parsed);
 }
 /* Parses all the lines in the file to easily assign the values to the variables
  */
@@ -183,50 +325,14 @@ static ReadInt getNext(FILE* fp)
  */
 static void setArray(const int* arr)
 {
-    V_QUEEN[0]  = arr[0];
-    V_QUEEN[1]  = arr[1];
-    V_ROOK[0] = arr[2];
-    V_ROOK[1] = arr[3];
-    V_BISH[0] = arr[4];
-    V_BISH[1] = arr[5];
-    V_KNIGHT[0] = arr[6];
-    V_KNIGHT[1] = arr[7];
-
-    CONNECTED_ROOKS[0] = arr[8];
-    CONNECTED_ROOKS[1] = arr[9];
-    ROOK_OPEN_FILE [0] = arr[10];
-    ROOK_OPEN_FILE [1] = arr[11];
-    SAFE_KING      [0] = arr[12];
-    SAFE_KING      [1] = arr[13];
-
-    BISH_PAIR      [0] = arr[14];
-    BISH_PAIR      [1] = arr[15];
-    KNIGHT_PAWNS   [0] = arr[16];
-    KNIGHT_PAWNS   [1] = arr[17];
-    N_KING_OPEN_FILE[0] = arr[18];
-    N_KING_OPEN_FILE[1] = arr[19];
-
-    PAWN_CHAIN     [0] = arr[20];
-    PAWN_CHAIN     [1] = arr[21];
-    PAWN_PROTECTION_BISH[0] = arr[22];
-    PAWN_PROTECTION_BISH[1] = arr[23];
-    PAWN_PROTECTION_KNIG[0] = arr[24];
-    PAWN_PROTECTION_KNIG[1] = arr[25];
-    ATTACKED_BY_PAWN[0] = arr[26];
-    ATTACKED_BY_PAWN[1] = arr[27];
-    N_DOUBLED_PAWNS[0] = arr[28];
-    N_DOUBLED_PAWNS[1] = arr[29];
-    QUEEN_CHECKS[0] = arr[30];
-    QUEEN_CHECKS[1] = arr[31];
-    N_ISOLATED_PAWN[0] = arr[32];
-    N_ISOLATED_PAWN[1] = arr[33];
-
-    BISH_MOB[0] = arr[34];
-    BISH_MOB[1] = arr[35];
-    KNIG_MOB[0] = arr[36];
-    KNIG_MOB[1] = arr[37];
-    PIECES_MOV[0] = arr[38];
-    PIECES_MOV[1] = arr[39];
+    for (int i = 0; i < NUM_VARS; ++i)
+    {
+        params[i][0] = arr[2*i];
+        params[i][1] = arr[2*i+1];
+    }
+
+    //The material of the boards depends on the values
+    initEval();
 }
 
 /* Saves the array into the harddrive, so in case it crashes no data is lost
@@ -254,186 +360,541 @@ static void saveArray(const int* arr)
     fclose(fp);
 }
 
-/* Load all the fens and results into memory
+/* Parses a line of the csv files: fen,result and optionally ,score for white.
+ * Returns 0 if it doesn't have a position
+ */
+static int parseLine(char* line, PackedPos* p)
+{
+    char* comma = strchr(line, ',');
+    if (comma == NULL || parseResult(comma[1]) == RESULT_NONE)
+    {
+        if (line[0] != '\n' && line[0] != '\0')
+            printf("[-] Invalid line %s", line);
+        return 0;
+    }
+
+    *comma = '\0';
+    char* score = strchr(comma + 1, ',');
+    if (!validFen(line))
+    {
+        printf("[-] Invalid fen %s\n", line);
+        return 0;
+    }
+
+    int _ignore;
+    const Board b = genFromFen(line, &_ignore);
+    //The static eval means nothing in check
+    if (isInCheck(&b, b.stm))
+    {
+        checkFens++;
+        return 0;
+    }
+    *p = packPosition(&b, parseResult(comma[1]), score? atoi(score + 1) : NO_SCORE);
+
+    return 1;
+}
+
+/* Load all the positions and results into memory, the binary files are only mapped
  */
 static void loadFensIntoMem(void)
 {
-    FILE* fp;
+    const time_t start = time(NULL);
+
+    if (binFiles)
+    {
+        if (!openPositions(fenFile, &posFile))
+            exit(EXIT_FAILURE);
+
+        positions = posFile.pos;
+        if (posFile.count < (uint64_t)num_pos)
+            num_pos = (int)posFile.count;
+        printf("[+] %d positions mapped from \'%s\'\n", num_pos, fenFile);
+        return;
+    }
+
+    FILE* fp = fopen(fenFile, "r");
+    if (fp == NULL)
+    {
+        printf("[-] Error opening \'%s\'\n", fenFile);
+        exit(EXIT_FAILURE);
+    }
+
     char* line = NULL;
     size_t len = 0;
-    ssize_t read;
+    int n = 0, size = 1 << 16;
+    parsed = malloc(size * sizeof(PackedPos));
+    CHECK_MALLOC(parsed);
 
-    fp = fopen(fenFile, "r");
-    if (fp == NULL)
+    while (n < num_pos && getline(&line, &len, fp) != -1)
+    {
+        if (n == size)
+        {
+            size *= 2;
+            parsed = realloc(parsed, size * sizeof(PackedPos));
+            CHECK_MALLOC(parsed);
+        }
+
+        n += parseLine(line, &parsed[n]);
+    }
+
+    fclose(fp);
+    free(line);
+
+    positions = parsed;
+    num_pos = n;
+    printf("[+] %d positions parsed from \'%s\' in %lds, %d in check skipped\n", num_pos, fenFile, (long)(time(NULL) - start), checkFens);
+}
+
+/* Writes the positions of the csv file into the binary one, the file is streamed
+ */
+static void convertFens(void)
+{
+    FILE* in = fopen(fenFile, "r");
+    if (in == NULL)
     {
         printf("[-] Error opening \'%s\'\n", fenFile);
         exit(EXIT_FAILURE);
     }
+    FILE* out = createPositions(binFile);
+    if (out == NULL)
+        exit(EXIT_FAILURE);
 
-    for (int i = 0; i < num_pos; ++i)
+    enum {CHUNK = 1 << 12};
+    PackedPos chunk[CHUNK];
+    char* line = NULL;
+    size_t len = 0;
+    int n = 0, total = 0;
+
+    while (total < num_pos && getline(&line, &len, in) != -1)
+    {
+        if (parseLine(line, &chunk[n]))
+        {
+            n++;
+            total++;
+        }
+        if (n == CHUNK)
+        {
+            writePositions(out, chunk, n);
+            n = 0;
+        }
+    }
+    writePositions(out, chunk, n);
+
+    fclose(in);
+    free(line);
+
+    if (!finishPositions(out))
+    {
+        printf("[-] Error writing \'%s\'\n", binFile);
+        exit(EXIT_FAILURE);
+    }
+    printf("[+] %d positions written to \'%s\', %d in check skipped\n", total, binFile, checkFens);
+}
+
+/* Resolves the position to the leaf of its qsearch pv: the best capture is played while it is better than
+ * standing pat. The children are searched with the full window (the pruning of qsearch depends on it) and
+ * always with the same depth, so a leaf is its own leaf. Returns 0 if it still isn't quiet after LEAF_DEPTH plies
+ */
+static int quietLeaf(Board* b)
+{
+    Move list[NMOVES];
+    History h;
+
+    for (int ply = 0; ; ++ply)
     {
-        if ((read = getline(&line, &len, fp)) != -1)
+        int best = qsearch(*b, MINS_INF, PLUS_INF, 0, 0); //Standing pat
+        int found = 0;
+        Board bestChild;
+        const int numMoves = legalMovesQuiesce(b, list) >> 1;
+
+        for (int i = 0; i < numMoves; ++i)
         {
-            positions[i] = (FenResult) {};
-            if (read > 1)
+            Board child = *b;
+            makeMove(&child, list[i], &h);
+            if (insuffMat(&child))
+                continue;
+
+            const int val = -qsearch(child, MINS_INF, PLUS_INF, LEAF_DEPTH - 1, 0);
+            if (val > best)
             {
-                for (int j = 0; j < 200; ++j)
+                best = val;
+                bestChild = child;
+                found = 1;
+            }
+        }
+
+        if (!found)
+            return 1;
+        if (ply == LEAF_DEPTH)
+            return 0;
+        *b = bestChild;
+    }
+}
+
+//Index of the value in params, -1 if it isn't tuned
+static int paramIndex(const int* term)
+{
+    for (int i = 0; i < NUM_VARS; ++i)
+        if (params[i] == term)
+            return i;
+
+    return -1;
+}
+
+static inline double taper(const int ph, const double op, const double eg)
+{
+    return (op * (255 ^ ph) + eg * ph) / 256;
+}
+
+/* Stores b in p as a linear function of the values, the constant part is computed with the current ones.
+ * The coefficients are written in coeffs
+ */
+static void linearForm(const Board* b, TunePos* p, Coeff* coeffs)
+{
+    EvalTrace t;
+    const int ev = traceEval(b, &t);
+
+    p->fifty = b->fifty;
+    p->ph = t.ph;
+    p->base[0] = t.result[0];
+    p->base[1] = t.result[1];
+    p->n = 0;
+    for (int j = 0; j < t.n; ++j)
+    {
+        const int var = paramIndex(t.term[j]);
+        if (var == -1)
+            continue;
+
+        p->base[0] -= t.coeff[j] * vals[2*var];
+        p->base[1] -= t.coeff[j] * vals[2*var+1];
+        coeffs[p->n++] = (Coeff) {.var = var, .coeff = t.coeff[j]};
+    }
+    //The tempo and the rounding of the tapered eval
+    p->offset = (b->stm? ev : -ev) - taper(p->ph, t.result[0], t.result[1]);
+}
+
+/* Multithreaded function to resolve the positions to their quiet leaves, called from each thread.
+ * The threads take chunks of LEAF_CHUNK positions until there are none left, the size of the qsearch varies a lot.
+ * The leaves are kept in leaves in the quiet pass and turned into their linear form when training,
+ * the ones that can't be used have RESULT_NONE
+ */
+static void* mthLeaves(void* _var)
+{
+    int beg;
+    Move list[NMOVES];
+    Coeff* coeffs = malloc(LEAF_CHUNK * NUM_VARS * sizeof(Coeff));
+    CHECK_MALLOC(coeffs);
+    int first[LEAF_CHUNK];
+
+    while ((beg = __atomic_fetch_add(&nextPos, LEAF_CHUNK, __ATOMIC_RELAXED)) < num_pos)
+    {
+        const int end = min(num_pos, beg + LEAF_CHUNK);
+        int n = 0;
+        for (int i = beg; i < end; ++i)
+        {
+            //The binary files are only mapped, so their records are checked here
+            const int valid = validPosition(&positions[i]);
+            Board b = valid? unpackPosition(&positions[i]) : (Board) {};
+
+            int usable = 0;
+            if (!valid)
+                __atomic_fetch_add(&corrupt, 1, __ATOMIC_RELAXED);
+            else if (!quietFens && !quietLeaf(&b))
+                __atomic_fetch_add(&notQuiet, 1, __ATOMIC_RELAXED);
+            //The static eval means nothing in check or if it is mate (or stalemate)
+            else if (isInCheck(&b, b.stm))
+                __atomic_fetch_add(&inCheck, 1, __ATOMIC_RELAXED);
+            else if ((legalMoves(&b, list) >> 1) == 0)
+                __atomic_fetch_add(&noMoves, 1, __ATOMIC_RELAXED);
+            else
+                usable = 1;
+
+            if (quietPass)
+            {
+                leaves[i].result = RESULT_NONE;
+                if (usable)
                 {
-                    if (line[j] == '\n')
-                    {
-                        printf("[-] Shouldn't be here!\n");
-                        positions[i].fen[0] = '\0';
-                        break;
-                    }
-                    if (line[j] == ',')
-                    {
-                        switch(line[j+1])
-                        {
-                            case 'w':
-                                positions[i].result = 1.0;
-                                break;
-                            case 'b':
-                                positions[i].result = 0.0;
-                                break;
-                            case 'd':
-                                positions[i].result = 0.5;
-                                break;
-                            default:
-                                printf("[-] UNSUPPORTED char %c\n", line[j+1]);
-                        }
-                        positions[i].fen[j] = '\0';
-                        break;
-                    }
-
-                    positions[i].fen[j] = line[j];
+                    const int ev = qsearch(b, MINS_INF, PLUS_INF, 0, 0);
+                    leaves[i] = packPosition(&b, positions[i].result, b.stm? ev : -ev);
                 }
+                continue;
+            }
+
+            first[i - beg] = n;
+            tunePos[i].n = 0;
+            tunePos[i].result = usable? positions[i].result : RESULT_NONE;
+            if (usable)
+            {
+                linearForm(&b, &tunePos[i], coeffs + n);
+                n += tunePos[i].n;
             }
         }
+
+        if (!quietPass)
+        {
+            Coeff* pool = malloc(max(n, 1) * sizeof(Coeff));
+            CHECK_MALLOC(pool);
+            memcpy(pool, coeffs, n * sizeof(Coeff));
+            chunkCoeffs[beg / LEAF_CHUNK] = pool;
+            for (int i = beg; i < end; ++i)
+                tunePos[i].coeffs = pool + first[i - beg];
+            __atomic_fetch_add(&numCoeffs, n, __ATOMIC_RELAXED);
+        }
     }
 
-    fclose(fp);
-    if (line) free(line);
+    free(coeffs);
+    return NULL;
 }
 
-static volatile int assign;
-/* Multithreaded function to calculate the error, called from each thread
+static void resolveLeaves(void)
+{
+    pthread_t thread_id[num_thr];
+
+    nextPos = 0;
+    for (int i = 0; i < num_thr; ++i)
+        pthread_create(&thread_id[i], NULL, mthLeaves, NULL);
+    for (int i = 0; i < num_thr; ++i)
+        pthread_join(thread_id[i], NULL);
+}
+
+/* Writes the quiet leaves of the positions with their results in quietFile, in the same order.
+ * The binary file also has the static eval of the leaves
  */
-static void* mthError(void* _var)
+static void writeQuietLeaves(void)
 {
-    const int limit = num_pos / num_thr;
-    int success = pthread_mutex_lock(&mutex);
-    const int threadOffset = assign;
-    assign++;
-    pthread_mutex_unlock(&mutex);
+    const time_t start = time(NULL);
+    leaves = malloc(num_pos * sizeof(PackedPos));
+    CHECK_MALLOC(leaves);
+    resolveLeaves();
 
-    if (success == -1)
-        printf("Couldn't lock\n");
+    FILE* fp = binFiles? createPositions(quietFile) : fopen(quietFile, "w");
+    if (fp == NULL)
+    {
+        printf("[-] Error opening \'%s\' in write mode\n", quietFile);
+        exit(EXIT_FAILURE);
+    }
 
-    int _ignore;
-    int qv, adjustedQV;
-    double error;
+    const char results[3] = {'b', 'd', 'w'};
+    char fen[128];
+    int written = 0;
+    for (int i = 0; i < num_pos; ++i)
+    {
+        if (leaves[i].result == RESULT_NONE)
+            continue;
 
-    double localAcc = 0;
-    Board b;
-    for (int i = 0; i < limit; ++i)
+        if (binFiles)
+            writePositions(fp, &leaves[i], 1);
+        else
+        {
+            generateFen(unpackPosition(&leaves[i]), fen);
+            fprintf(fp, "%s,%c\n", fen, results[leaves[i].result]);
+        }
+        written++;
+    }
+    if (binFiles? !finishPositions(fp) : fclose(fp) != 0)
     {
-        b = genFromFen(positions[num_thr*i+threadOffset].fen, &_ignore);
-        qv = qsearch(b, MINS_INF, PLUS_INF, 7);
-        adjustedQV = b.stm? qv : -qv;
-        error = positions[num_thr*i+threadOffset].result - sigmoid(adjustedQV);
-        localAcc += error * error;
+        printf("[-] Error writing \'%s\'\n", quietFile);
+        exit(EXIT_FAILURE);
     }
+    free(leaves);
 
-    acc[threadOffset] = localAcc;
+    printf("[+] %d positions resolved in %lds with %d threads\n", num_pos, (long)(time(NULL) - start), num_thr);
+    printf("[+] Dropped %d corrupt, %d in check, %d without moves and %d not quiet after %d plies\n", corrupt, inCheck, noMoves, notQuiet, LEAF_DEPTH);
+    printf("[+] %d written to \'%s\'\n", written, quietFile);
+}
 
-    return NULL;
+static inline double fiftyScale(const TunePos* p)
+{
+    return (100 - p->fifty) / 100.0;
 }
 
-static double error(void)
+/* Score for white of the position with the values theta, what evaluate would return
+ */
+static inline double linearEval(const TunePos* p, const Coeff* coeffs, const double* theta)
 {
-    //Set up the multithread vars
-    assign = 0;
+    double op = p->base[0], eg = p->base[1];
+    for (int i = 0; i < p->n; ++i)
+    {
+        op += coeffs[i].coeff * theta[2*coeffs[i].var];
+        eg += coeffs[i].coeff * theta[2*coeffs[i].var+1];
+    }
 
-    setArray(vals);
-    pthread_t thread_id[num_thr];
+    return fiftyScale(p) * (p->offset + taper(p->ph, op, eg));
+}
+
+/* Error and gradient of the positions of the job
+ */
+static void gradient(Job* job)
+{
+    memset(job->grad, 0, sizeof(job->grad));
+    job->error = 0;
+
+    for (int i = job->beg; i < job->end; ++i)
+    {
+        const TunePos* p = &tunePos[i];
+        const Coeff* coeffs = p->coeffs;
+        const double sig = sigmoid(linearEval(p, coeffs, job->theta));
+        const double error = p->result / 2.0 - sig;
+        job->error += error * error;
+
+        //d(error^2) / d(eval), the factor of the sigmoid is applied once for all
+        const double d = -2 * error * sig * (1 - sig) * fiftyScale(p);
+        const double dOp = d * (255 ^ p->ph) / 256;
+        const double dEg = d * p->ph / 256;
+        for (int j = 0; j < p->n; ++j)
+        {
+            job->grad[2*coeffs[j].var]   += dOp * coeffs[j].coeff;
+            job->grad[2*coeffs[j].var+1] += dEg * coeffs[j].coeff;
+        }
+    }
+}
 
-    //Launch the threads
+/* The workers are created once, each batch they take jobs until there are none left
+ */
+static void* mthGradient(void* _var)
+{
+    while (1)
+    {
+        pthread_barrier_wait(&batchStart);
+        if (stopWorkers)
+            return NULL;
+
+        int j;
+        while ((j = __atomic_fetch_add(&nextJob, 1, __ATOMIC_RELAXED)) < numJobs)
+            gradient(&jobs[j]);
+        pthread_barrier_wait(&batchDone);
+    }
+}
+
+static void startWorkers(void)
+{
+    jobs = malloc(((num_pos + GRAD_CHUNK - 1) / GRAD_CHUNK) * sizeof(Job));
+    workers = malloc(num_thr * sizeof(pthread_t));
+    CHECK_MALLOC(jobs);
+    CHECK_MALLOC(workers);
+
+    stopWorkers = 0;
+    pthread_barrier_init(&batchStart, NULL, num_thr + 1);
+    pthread_barrier_init(&batchDone, NULL, num_thr + 1);
     for (int i = 0; i < num_thr; ++i)
-        pthread_create(&thread_id[i], NULL, mthError, NULL);
-    //Wait for them to end
+        pthread_create(&workers[i], NULL, mthGradient, NULL);
+}
+
+static void endWorkers(void)
+{
+    stopWorkers = 1;
+    pthread_barrier_wait(&batchStart);
     for (int i = 0; i < num_thr; ++i)
-        pthread_join(thread_id[i], NULL);
+        pthread_join(workers[i], NULL);
+
+    pthread_barrier_destroy(&batchStart);
+    pthread_barrier_destroy(&batchDone);
+    free(workers);
+    free(jobs);
+}
+
+/* Error of [beg, end) with the values theta, the gradient (without the factor of the sigmoid) is added to grad
+ */
+static double error(const double* theta, const int beg, const int end, double* grad)
+{
+    numJobs = (end - beg + GRAD_CHUNK - 1) / GRAD_CHUNK;
+    for (int j = 0; j < numJobs; ++j)
+        jobs[j] = (Job) {.beg = beg + j * GRAD_CHUNK, .end = min(end, beg + (j + 1) * GRAD_CHUNK), .theta = theta};
+    nextJob = 0;
+
+    pthread_barrier_wait(&batchStart);
+    pthread_barrier_wait(&batchDone);
 
-    //Collect the results
     double res = 0;
-    for (int i = 0; i < num_thr; ++i)
-        res += acc[i];
+    for (int j = 0; j < numJobs; ++j)
+    {
+        res += jobs[j].error;
+        if (grad)
+            for (int k = 0; k < 2*NUM_VARS; ++k)
+                grad[k] += jobs[j].grad[k];
+    }
 
-    return res / num_pos;
+    return res / (end - beg);
 }
 
-/* This finds a local minimum
- * It is guaranteed to terminate since the search space is finite, and simple enough
- * so that there are no bugs
+/* Every position is turned into the white score of its quiet leaf as a linear function of the values,
+ * the constant part and the coefficients are stored once. The values are tuned with Adam over batches
+ * of them, which only needs a few multiplications per position instead of a qsearch
  */
 static void optimize(void)
 {
-    double bestVal = error();
-    int improved = 1, oneMore = 1, iter = 0;
+    const double beta1 = 0.9, beta2 = 0.999, eps = 1e-8;
+    const double K = 0.00518078; //The factor of the sigmoid
 
-    printf("Start training with %d threads, %d variables, and %d positions\n", num_thr, NUM_VARS, num_pos);
-    printf("Init E: %.12f\n", bestVal);
+    double theta[2*NUM_VARS], m[2*NUM_VARS] = {0}, v[2*NUM_VARS] = {0}, grad[2*NUM_VARS];
+    int frozen[2*NUM_VARS];
+    for (int i = 0; i < 2*NUM_VARS; ++i)
+    {
+        theta[i] = vals[i];
+        frozen[i] = vals[i] == 0; //Disabled terms
+    }
 
-    return;
+    const time_t start = time(NULL);
+    resolveLeaves();
 
-    do
+    //Only the leaves that can be used are kept
+    int kept = 0;
+    for (int i = 0; i < num_pos; ++i)
+        if (tunePos[i].result != RESULT_NONE)
+            tunePos[kept++] = tunePos[i];
+    if (kept < num_pos)
+        printf("[+] Dropped %d corrupt, %d in check, %d without moves and %d not quiet after %d plies\n", corrupt, inCheck, noMoves, notQuiet, LEAF_DEPTH);
+    num_pos = kept;
+
+    //The batches are taken in a random order instead of the one of the file, the seed is fixed to keep the results reproducible
+    srand(7);
+    for (int i = num_pos - 1; i > 0; --i)
     {
-        iter++;
-        oneMore = 0;
-        for (int var = 0; var < 2*NUM_VARS; ++var)
-        {
-            improved = 0;
-            if (vals[var] >= val_lim || vals[var] <= -val_lim || vals[var] == 0) continue;
+        const int j = (int)(((unsigned)rand() << 15 ^ (unsigned)rand()) % (unsigned)(i + 1));
+        const TunePos tmp = tunePos[i];
+        tunePos[i] = tunePos[j];
+        tunePos[j] = tmp;
+    }
+    startWorkers();
 
-            int best = vals[var];
-            vals[var]++;
-            initEval(); //To ensure that the change have been applied for some variables (such as passed pawns)
-            double newVal = error();
+    printf("Start training with %d threads, %d variables, and %d positions\n", num_thr, NUM_VARS, num_pos);
+    printf("Leaves computed in %lds, %.1f bytes per position\n", (long)(time(NULL) - start),
+        sizeof(TunePos) + (double)numCoeffs * sizeof(Coeff) / num_pos);
+    printf("Init E: %.12f\n", error(theta, 0, num_pos, NULL));
 
-            while (newVal < bestVal)
-            {
-                improved = 1;
-                best = vals[var];
-                bestVal = newVal;
-                vals[var]++;
-                initEval();
-                newVal = error();
-            }
-            if(!improved)
+    int step = 0;
+    for (int epoch = 1; epoch <= num_epochs; ++epoch)
+    {
+        for (int beg = 0; beg < num_pos; beg += batch_size)
+        {
+            const int end = min(num_pos, beg + batch_size);
+            memset(grad, 0, sizeof(grad));
+            error(theta, beg, end, grad);
+
+            ++step;
+            for (int i = 0; i < 2*NUM_VARS; ++i)
             {
-                vals[var] -= 2;
-                initEval();
-                newVal = error();
-                while(newVal < bestVal)
-                {
-                    improved = 1;
-                    bestVal = newVal;
-                    best = vals[var];
-                    vals[var]--;
-                    initEval();
-                    newVal = error();
-                }
+                if (frozen[i])
+                    continue;
+
+                const double g = K * grad[i] / (end - beg);
+                m[i] = beta1 * m[i] + (1 - beta1) * g;
+                v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+                const double mHat = m[i] / (1 - pow(beta1, step));
+                const double vHat = v[i] / (1 - pow(beta2, step));
+                theta[i] -= learning_rate * mHat / (sqrt(vHat) + eps);
+                theta[i] = fmax(-val_lim, fmin(val_lim, theta[i]));
             }
-
-            oneMore |= improved;
-            vals[var] = best;
         }
 
         //Output the error and save the vals
-        printf("E: %.12f\n", bestVal);
+        for (int i = 0; i < 2*NUM_VARS; ++i)
+            vals[i] = (int)lround(theta[i]);
+        printf("Epoch %d E: %.12f\n", epoch, error(theta, 0, num_pos, NULL));
         saveArray(vals);
-    } while (oneMore);
+    }
 
-    saveArray(vals);
-    printf("Optimum E: %.12f\n", bestVal);
+    printf("Optimum E: %.12f\n", error(theta, 0, num_pos, NULL));
+    endWorkers();
 }
+#endif
\ No newline at end of file
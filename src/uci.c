@@ -7,11 +7,14 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include "../include/global.h"
 #include "../include/board.h"
 #include "../include/moves.h"
 #include "../include/boardmoves.h"
+#include "../include/allmoves.h"
 #include "../include/hash.h"
 #include "../include/search.h"
 #include "../include/io.h"
@@ -19,6 +22,7 @@
 #include "../include/uci.h"
 #include "../include/mate.h"
 #include "../include/nnue.h"
+#include "../include/nnuekernels.h"
 #include "../include/perft.h"
 
 #define LEN 4096
@@ -28,12 +32,73 @@ static void isready(void);
 static void perft_(Board b, int depth);
 static void mate_(Board b, int depth);
 static void eval_(Board b);
+static void bench_(int depth);
+static void benchNNUE_(void);
+static void profileNNUE_(void);
 static void go_(Board b, char* beg, Repetition* rep);
 static void help_(void);
 static int move_(Board* b, char* beg, Repetition* rep);
 static Board gen_(char* beg, Repetition* rep);
 static Board gen_def(char* beg, Repetition* rep);
 
+/* stdin read in blocks, so that it can be known if the next line is already there
+ * or reading it would wait for the one that writes the fens. The commands and the fens
+ * of evalfens are read from the same buffer, so nothing is lost between them
+ */
+typedef struct
+{
+    char buf[1 << 16];
+    int beg, end;
+    int eof;
+    int skip;
+} Input;
+
+static Input input;
+
+/* Copies the next line (without the '\n') into line, the lines longer than LEN are cut.
+ * Returns 0 at the end of the input or, if wait is 0, when there isn't a whole line to read yet
+ */
+static int nextLine(Input* in, char* line, const int wait)
+{
+    while (1)
+    {
+        const char* beg = in->buf + in->beg;
+        const char* nl = memchr(beg, '\n', (size_t)(in->end - in->beg));
+        if (nl || (in->eof && in->beg < in->end) || in->end - in->beg == sizeof(in->buf))
+        {
+            const int len = nl? (int)(nl - beg) : in->end - in->beg;
+            in->beg += len + (nl != NULL);
+            //The rest of a line that has been cut
+            const int skip = in->skip;
+            in->skip = nl == NULL;
+            if (skip)
+                continue;
+
+            const int copied = min(len, LEN - 2);
+            memcpy(line, beg, (size_t)copied);
+            //genFromFen reads past the en passant sqr
+            line[copied] = line[copied + 1] = '\0';
+            return 1;
+        }
+        if (in->eof)
+            return 0;
+
+        memmove(in->buf, beg, (size_t)(in->end - in->beg));
+        in->end -= in->beg;
+        in->beg = 0;
+
+        struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+        if (!wait && poll(&fd, 1, 0) <= 0)
+            return 0;
+
+        const ssize_t r = read(STDIN_FILENO, in->buf + in->end, sizeof(in->buf) - (size_t)in->end);
+        if (r <= 0)
+            in->eof = 1;
+        else
+            in->end += (int)r;
+    }
+}
+
 /* Main loop, listens to user input and performs the desired actions
  */
 void loop(void)
@@ -41,15 +106,21 @@ void loop(void)
     Board b = defaultBoard();
     Repetition rep = (Repetition) {.index = 0};
 
-    char input[LEN];
-    char* res, *beg;
+    char line[LEN];
+    char* beg;
     int quit = 0;
 
     while(!quit)
     {
-        res = fgets(input, LEN, stdin);
-        if (res == NULL) return;
-        beg = input;
+        if (!nextLine(&input, line, 1)) return;
+        //The commands are parsed with the '\n' at the end
+        line[strlen(line)] = '\n';
+        beg = line;
+
+        //A net loaded in the background is used from the next command, never in the middle of a search
+        #ifdef USE_NNUE
+        swapNNUE(0);
+        #endif
 
         if (strncmp(beg, "isready", 7) == 0)
             isready();
@@ -82,9 +153,24 @@ void loop(void)
         else if (strncmp(beg, "perft", 5) == 0)
             perft_(b, atoi(beg + 6));
 
+        else if (strncmp(beg, "evalfens", 8) == 0)
+            evalFens(atoi(beg + 8));
+
         else if (strncmp(beg, "eval", 4) == 0)
             eval_(b);
 
+        else if (strncmp(beg, "benchkernels", 12) == 0)
+            benchKernels();
+
+        else if (strncmp(beg, "profilennue", 11) == 0)
+            profileNNUE_();
+
+        else if (strncmp(beg, "benchnnue", 9) == 0)
+            benchNNUE_();
+
+        else if (strncmp(beg, "bench", 5) == 0)
+            bench_(atoi(beg + 5));
+
         else if (strncmp(beg, "mate", 4) == 0)
             mate_(b, atoi(beg + 5));
 
@@ -94,13 +180,16 @@ void loop(void)
             char* b = beg;
             while (*b != '\n') b++;
             *b = '\0';
-            initNNUE(beg + 9);
+            loadNNUEAsync(beg + 9);
             #else
             fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
             fflush(stderr);
             #endif
         }
 
+        else if (strncmp(beg, "lazynnue", 8) == 0)
+            setLazyMargin(atoi(beg + 9));
+
         else if (strncmp(beg, "quit", 4) == 0)
             quit = 1;
 
@@ -121,8 +210,12 @@ static void uci(void)
     fprintf(stdout, "uciok\n");
     fflush(stdout);
 }
+//The engine isn't ready until the net that is being loaded can be used
 static void isready(void)
 {
+    #ifdef USE_NNUE
+    swapNNUE(1);
+    #endif
     fprintf(stdout, "readyok\n");
     fflush(stdout);
 }
@@ -151,11 +244,247 @@ static void eval_(Board b)
     #ifdef USE_NNUE
     const int ev = evaluateNNUE(&b, 0);
     #else
-    const int ev = eval(&b);
+    int lazy;
+    const int ev = eval(&b, MINS_INF, PLUS_INF, &lazy);
     #endif
     fprintf(stdout, "%d\n", ev);
     fflush(stdout);
 }
+
+/* Reads fens, one per line, until "end" or the end of the input and writes the evaluation of each one
+ * (the same as eval) in the same order, or "invalid" if the line isn't a fen. They are evaluated in chunks,
+ * with all the cores if threads is 0, a chunk is written once it is full or when the next fen isn't there yet
+ */
+void evalFens(int threads)
+{
+    #ifdef USE_NNUE
+    enum {CHUNK = 1 << 14};
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    Board* boards = malloc(sizeof(Board) * CHUNK);
+    int* scores = malloc(sizeof(int) * CHUNK);
+    char* valid = malloc(CHUNK);
+    CHECK_MALLOC(boards);
+    CHECK_MALLOC(scores);
+    CHECK_MALLOC(valid);
+
+    char line[LEN];
+    int n = 0, numValid = 0, done = 0;
+    long lineNum = 0;
+    while (!done)
+    {
+        //It only waits for the input if there is nothing to write
+        const int read = nextLine(&input, line, n == 0);
+        done = (!read && input.eof) || (read && strncmp(line, "end", 3) == 0);
+        if (read && !done && line[0] != '\0')
+        {
+            ++lineNum;
+            valid[n] = (char)validFen(line);
+            if (valid[n])
+            {
+                int ignore;
+                boards[numValid++] = genFromFen(line, &ignore);
+            }
+            else
+                fprintf(stderr, "Invalid fen in line %ld: %s\n", lineNum, line);
+            ++n;
+        }
+
+        if (n && (n == CHUNK || done || !read))
+        {
+            evaluateBatch(loadedNNUE(), boards, scores, numValid, threads);
+            for (int i = 0, j = 0; i < n; ++i)
+            {
+                if (valid[i])
+                    fprintf(stdout, "%d\n", scores[j++]);
+                else
+                    fprintf(stdout, "invalid\n");
+            }
+            fflush(stdout);
+            n = numValid = 0;
+        }
+    }
+
+    free(boards);
+    free(scores);
+    free(valid);
+    #else
+    fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
+    fflush(stderr);
+    #endif
+}
+/* Fixed set of positions searched by bench, the total node count works as a
+ * signature of the search, any change in it means that the search has changed
+ */
+static char* benchFens[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq -",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+    "r1bqk2r/pp3ppp/2n2n2/3pp1B1/1b6/1BNP4/PPP1NPPP/R2QK2R b KQkq -",
+    "r1bq1rk1/p1pnppbp/1pnp2p1/8/3PP3/3Q1NPP/PPP2PB1/RNB2RK1 b - -",
+    "rnbqkbnr/pp2pppp/4P3/2pp4/3N4/8/PPPP1PPP/RNBQKB1R w KQkq -",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq -",
+    "5b2/7p/3p2bk/2p2pN1/2P2P2/P1QPqB1P/7K/8 w - -",
+    "7r/p3k3/1p2p2n/2p2p1R/2P5/4K2B/7P/8 b - -",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -",
+    "8/ppp5/8/PPP5/8/8/5K1k/8 w - -",
+};
+
+static void bench_(int depth)
+{
+    const int numFens = sizeof(benchFens) / sizeof(benchFens[0]);
+    uint64_t totNodes = 0;
+    #if defined(USE_NNUE) && defined(DEBUG)
+    uint64_t totNNUE = 0, totLazy = 0;
+    #elif defined(DEBUG)
+    uint64_t evals0, psqtExits0, cheapExits0;
+    lazyEvalCounts(&evals0, &psqtExits0, &cheapExits0);
+    #endif
+    clock_t startTime = clock();
+
+    if (depth <= 0)
+        depth = 11;
+
+    for (int i = 0; i < numFens; ++i)
+    {
+        int ignore;
+        Board b = genFromFen(benchFens[i], &ignore);
+        Repetition rep = (Repetition) {.index = 1, .hashTable = {hashPosition(&b)}};
+
+        initializeTable();
+        bestTime(b, rep, (SearchParams) {.depth = depth});
+        totNodes += searchedNodes();
+
+        #if defined(USE_NNUE) && defined(DEBUG)
+        uint64_t nnueEvals, lazyEvals;
+        evalCounts(&nnueEvals, &lazyEvals);
+        totNNUE += nnueEvals;
+        totLazy += lazyEvals;
+        #endif
+    }
+
+    const clock_t duration = 1000 * (clock() - startTime) / CLOCKS_PER_SEC;
+    initializeTable();
+
+    fprintf(stdout, "Nodes: %lu\n", totNodes);
+    fprintf(stdout, "Time: %lums\n", duration);
+    fprintf(stdout, "NPS: %lu\n", 1000 * totNodes / (uint64_t)(duration + 1));
+    #if defined(USE_NNUE) && defined(DEBUG)
+    fprintf(stdout, "NNUE evals avoided: %.1f%%\n", 100.0 * (double)totLazy / (double)(totNNUE + totLazy + 1));
+    #elif defined(DEBUG)
+    uint64_t evals, psqtExits, cheapExits;
+    lazyEvalCounts(&evals, &psqtExits, &cheapExits);
+    evals -= evals0; psqtExits -= psqtExits0; cheapExits -= cheapExits0;
+    fprintf(stdout, "Lazy evals: %.1f%% after the psqt, %.1f%% after the cheap terms\n",
+        100.0 * psqtExits / (evals + 1), 100.0 * cheapExits / (evals + 1));
+    #endif
+    fflush(stdout);
+}
+#ifdef USE_NNUE
+/* Positions 2 plies after the bench positions, the corpus of the NNUE benchmarks
+ */
+static int benchPositions(Board* positions, const int maxPositions)
+{
+    const int numFens = sizeof(benchFens) / sizeof(benchFens[0]);
+    int numPositions = 0;
+    for (int i = 0; i < numFens; ++i)
+    {
+        int ignore;
+        Board b = genFromFen(benchFens[i], &ignore);
+        Move list[NMOVES], list2[NMOVES];
+        History h, h2;
+
+        const int n = legalMoves(&b, list) >> 1;
+        for (int j = 0; j < n; ++j)
+        {
+            makeMove(&b, list[j], &h);
+            const int n2 = legalMoves(&b, list2) >> 1;
+            for (int k = 0; k < n2 && numPositions < maxPositions; ++k)
+            {
+                positions[numPositions] = b;
+                makeMove(&positions[numPositions++], list2[k], &h2);
+            }
+            undoMove(&b, list[j], &h);
+        }
+    }
+    return numPositions;
+}
+#endif
+
+/* Evaluations per second of the loaded net with each set of kernels, on the positions 2 plies
+ * after the bench positions. The accumulator is computed beforehand so it only times the layers
+ */
+static void benchNNUE_(void)
+{
+    #ifdef USE_NNUE
+    enum {ITERATIONS = 50, MAX_POSITIONS = 1 << 15};
+
+    Board* positions = malloc(sizeof(Board) * MAX_POSITIONS);
+    CHECK_MALLOC(positions);
+    const int numPositions = benchPositions(positions, MAX_POSITIONS);
+
+    fprintf(stdout, "%d positions\n", numPositions);
+    for (int k = 0; k < kernelSets(); ++k)
+    {
+        if (!selectKernels(k))
+            continue;
+
+        int64_t checksum = 0;
+        clock_t duration = 0;
+        for (int i = 0; i < numPositions; ++i)
+        {
+            initNNUEAcc(&positions[i]);
+
+            const clock_t startTime = clock();
+            for (int it = 0; it < ITERATIONS; ++it)
+                checksum += evaluateNNUE(&positions[i], 1);
+            duration += clock() - startTime;
+        }
+
+        const double seconds = (double)duration / CLOCKS_PER_SEC;
+        fprintf(stdout, "%-8s %10.0f evals/s  checksum %ld\n", kernelName(), (double)numPositions * ITERATIONS / seconds, checksum);
+    }
+    defaultKernels();
+    free(positions);
+    #else
+    fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
+    #endif
+    fflush(stdout);
+}
+
+/* Cost of each part of the evaluation with the loaded net and the selected kernels, see profileNNUE.
+ * Each bench position 2 plies deep is paired with one of its legal moves, always the same one
+ */
+static void profileNNUE_(void)
+{
+    #ifdef USE_NNUE
+    enum {ITERATIONS = 20, MAX_POSITIONS = 1 << 15};
+
+    Board* positions = malloc(sizeof(Board) * MAX_POSITIONS);
+    Move* moves = malloc(sizeof(Move) * MAX_POSITIONS);
+    CHECK_MALLOC(positions);
+    CHECK_MALLOC(moves);
+    const int generated = benchPositions(positions, MAX_POSITIONS);
+
+    int numPositions = 0;
+    for (int i = 0; i < generated; ++i)
+    {
+        Move list[NMOVES];
+        const int n = legalMoves(&positions[i], list) >> 1;
+        if (n == 0)
+            continue;
+        positions[numPositions] = positions[i];
+        moves[numPositions++] = list[(7 * i) % n];
+    }
+
+    profileNNUE(loadedNNUE(), positions, moves, numPositions, ITERATIONS);
+    free(positions);
+    free(moves);
+    #else
+    fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
+    #endif
+    fflush(stdout);
+}
 static void go_(Board b, char* beg, Repetition* rep)
 {
     SearchParams sp = {.depth = 0, .timeToMove = 0, .extraTime = 0};
@@ -342,6 +671,7 @@ static void help_(void)
     fprintf(stdout, "ucinewgame......Load starting position\n");
     fprintf(stdout, "isready.........To ensure the engine is ready to receive commands\n");
     fprintf(stdout, "eval............Static evaluation of loaded position\n");
+    fprintf(stdout, "evalfens #......NNUE evaluation of the fens that follow, one per line until 'end', with # threads\n");
     fprintf(stdout, "position\n");
     fprintf(stdout, "  startpos......Load starting position\n");
     fprintf(stdout, "  fen <fen>.....Load the fen's position\n");
@@ -349,7 +679,12 @@ static void help_(void)
     fprintf(stdout, "print...........Draw the position on the screen\n");
     fprintf(stdout, "perft #.........Count the number of legal positions at depth #\n");
     fprintf(stdout, "mate #..........Determine the shortest mate within # plies\n");
-    fprintf(stdout, "loadnnue <path>.Load the NNUE file <path>\n");
+    fprintf(stdout, "bench #.........Search a fixed set of positions at depth #\n");
+    fprintf(stdout, "benchkernels....Time the NNUE kernels the cpu supports\n");
+    fprintf(stdout, "benchnnue.......Evaluations per second of the NNUE with each set of kernels\n");
+    fprintf(stdout, "profilennue.....Time of the refreshes, updates and layers of the NNUE and its cache misses\n");
+    fprintf(stdout, "loadnnue <path>.Load the NNUE file <path> in the background, isready waits for it\n");
+    fprintf(stdout, "lazynnue #......Use the material and psts instead of the NNUE # cp outside of the window, 0 never\n");
     fprintf(stdout, "go\n");
     fprintf(stdout, "   depth #......Analyze at depth\n");
     fprintf(stdout, "   wtime #......Analyze until the time runs out\n");